@@ -1,11 +1,30 @@
+#define _GNU_SOURCE // pthread_setaffinity_np, CPU_SET
+
 #include <ctype.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__BMI2__) || defined(__AVX2__)
+#include <immintrin.h> // _pext_u64, NNUE kernels
+#endif
+
+#if defined(STATS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h> // __rdtsc for the stats timers
+#endif
 
 #define auto __auto_type
 
@@ -20,9 +39,21 @@ typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
 
+typedef int8_t i8;
+typedef int16_t i16;
+typedef int32_t i32;
+typedef int64_t i64;
+
 typedef size_t usize;
 typedef ptrdiff_t isize;
 
+// Monotonic wall clock
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
 /* =========================
    Vector / Coordinates
    ========================= */
@@ -39,6 +70,13 @@ typedef struct v2 {
 #define WHITE 0
 #define BLACK 1
 
+#define PAWN 1
+#define KNIGHT 2
+#define BISHOP 3
+#define ROOK 4
+#define QUEEN 5
+#define KING 6
+
 typedef struct piece_t {
   u8 id;      // 1=pawn, 2=knight, 3=bishop, 4=rook, 5=queen, 6=king, 0=empty
   bool color; // WHITE or BLACK
@@ -47,11 +85,205 @@ typedef struct piece_t {
 #define WIDTH 8
 #define HEIGHT 8
 
+#define NO_SQUARE UINT8_MAX
+
+// Castling rights, one bit each
+#define CASTLE_WK 1 // white king side (O-O)
+#define CASTLE_WQ 2 // white queen side (O-O-O)
+#define CASTLE_BK 4
+#define CASTLE_BQ 8
+
+// What a move destroys beyond the pieces it moves. make_move saves it
+// whole in the undo record and unmake_move copies it back.
+typedef struct pos_state_t {
+  u8 castling;  // CASTLE_* bits still available
+  u8 ep_square; // square behind a pawn that just moved two and can be
+                // taken there, or NO_SQUARE
+  u8 rule50;    // plies since the last capture or pawn move
+  u16 ply;      // plies since the game started, fullmove = ply / 2 + 1
+  u64 key;      // Zobrist hash of the whole position
+} pos_state_t;
+
+// Square index = y * WIDTH + x, so bit 0 is a1 and bit 63 is h8.
 typedef struct board_t {
-  bool next_to_move; // WHITE or BLACK
-  piece_t handle[WIDTH * HEIGHT];
+  bool next_to_move;    // WHITE or BLACK
+  u64 pieces[KING + 1]; // one bitboard per piece id, [0] unused
+  u64 colors[2];        // all pieces of WHITE / BLACK
+  u64 occupied;         // colors[WHITE] | colors[BLACK]
+  // Redundant views of the bitboards, kept in step by put/remove_piece
+  u8 mailbox[64];                // id | color << 3 per square, 0 if empty
+  u8 king_sq[2];                 // NO_SQUARE if that king is missing
+  u8 piece_count[2][KING + 1];   // by colour and id
+  pos_state_t st;
+  i16 psq[2];           // material + piece-square score, white minus black,
+                        // for middlegame [0] and endgame [1]
+  u8 phase;             // PHASE_MAX with all pieces on, 0 with pawns only
 } board_t;
 
+/* =========================
+   Statistics (built with -DSTATS)
+   ========================= */
+
+// Hot path counters and cycle timers. Each thread counts into its own
+// copy, added to the totals when the thread is done; the report is
+// printed at exit. Without STATS the macros expand to nothing.
+
+// make_move is timed in the search, with the NNUE update if any
+enum { TIMER_GEN_LEGALS, TIMER_MAKE_MOVE, TIMER_EVAL, TIMER_COUNT };
+
+typedef struct stats_t {
+  u64 gen_pieces[KING + 1]; // pieces whose moves were generated, by id
+  u64 gen_calls[3];         // gen_legals calls by GEN_* kind
+  u64 is_attacked;
+  u64 legality_tests; // is_legal_move: make, test the king, unmake
+  u64 legality_rejects;
+  u64 tt_move_tests; // hash moves checked before being searched
+  u64 tt_move_rejects;
+  u64 tt_probes;
+  u64 tt_hits;
+  u64 nodes;  // negamax nodes
+  u64 qnodes; // quiescence nodes
+  u64 cutoffs;
+  u64 first_move_cutoffs; // cutoffs by the first move searched
+  u64 timer_cycles[TIMER_COUNT];
+  u64 timer_calls[TIMER_COUNT];
+} stats_t;
+
+static const char *stats_file; // JSON report goes here, if set by -stats
+
+#ifdef STATS
+
+static _Thread_local stats_t stats_local;
+static stats_t stats_total;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline u64 stats_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts; // no cycle counter: nanoseconds
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
+#endif
+}
+
+#define STAT_INC(field) (++stats_local.field)
+#define STAT_ADD(field, n) (stats_local.field += (n))
+#define STAT_TIMER_START(t) u64 stats_start_##t = stats_cycles()
+#define STAT_TIMER_STOP(t)                                                     \
+  (stats_local.timer_cycles[t] += stats_cycles() - stats_start_##t,            \
+   ++stats_local.timer_calls[t])
+
+// Add this thread's counts to the totals and start over
+static void stats_flush(void) {
+  pthread_mutex_lock(&stats_lock);
+  u64 *dst = (u64 *)&stats_total, *src = (u64 *)&stats_local;
+  for (usize i = 0; i < sizeof(stats_t) / sizeof(u64); ++i)
+    dst[i] += src[i];
+  pthread_mutex_unlock(&stats_lock);
+  memset(&stats_local, 0, sizeof(stats_local));
+}
+
+static double stats_pct(u64 part, u64 whole) {
+  return whole ? 100.0 * (double)part / (double)whole : 0.0;
+}
+
+static const char *timer_names[TIMER_COUNT] = {"gen_legals", "make_move",
+                                               "eval"};
+static const char *gen_kind_names[3] = {"all", "captures", "quiets"};
+static const char *piece_names[KING + 1] = {"",     "pawn",  "knight", "bishop",
+                                            "rook", "queen", "king"};
+
+static void stats_report_json(FILE *f, const stats_t *st) {
+  fprintf(f, "{\n  \"gen_pieces\": {");
+  for (int id = PAWN; id <= KING; ++id)
+    fprintf(f, "%s\"%s\": %llu", id == PAWN ? "" : ", ", piece_names[id],
+            (unsigned long long)st->gen_pieces[id]);
+  fprintf(f, "},\n  \"gen_calls\": {");
+  for (int k = 0; k < 3; ++k)
+    fprintf(f, "%s\"%s\": %llu", k ? ", " : "", gen_kind_names[k],
+            (unsigned long long)st->gen_calls[k]);
+  fprintf(f, "},\n");
+#define STATS_JSON_FIELD(name)                                                 \
+  fprintf(f, "  \"" #name "\": %llu,\n", (unsigned long long)st->name)
+  STATS_JSON_FIELD(is_attacked);
+  STATS_JSON_FIELD(legality_tests);
+  STATS_JSON_FIELD(legality_rejects);
+  STATS_JSON_FIELD(tt_move_tests);
+  STATS_JSON_FIELD(tt_move_rejects);
+  STATS_JSON_FIELD(tt_probes);
+  STATS_JSON_FIELD(tt_hits);
+  STATS_JSON_FIELD(nodes);
+  STATS_JSON_FIELD(qnodes);
+  STATS_JSON_FIELD(cutoffs);
+  STATS_JSON_FIELD(first_move_cutoffs);
+#undef STATS_JSON_FIELD
+  fprintf(f, "  \"timers\": {");
+  for (int t = 0; t < TIMER_COUNT; ++t)
+    fprintf(f, "%s\"%s\": {\"calls\": %llu, \"cycles\": %llu}",
+            t ? ", " : "", timer_names[t],
+            (unsigned long long)st->timer_calls[t],
+            (unsigned long long)st->timer_cycles[t]);
+  fprintf(f, "}\n}\n");
+}
+
+static void stats_report(void) {
+  stats_flush(); // whatever the main thread counted itself
+  const stats_t *st = &stats_total;
+  if (stats_file) {
+    FILE *f = fopen(stats_file, "w");
+    if (f) {
+      stats_report_json(f, st);
+      fclose(f);
+      return;
+    }
+    fprintf(stderr, "cannot write %s, stats follow\n", stats_file);
+  }
+
+  fprintf(stderr, "stats:\n  pieces generated:");
+  for (int id = PAWN; id <= KING; ++id)
+    fprintf(stderr, " %s %llu", piece_names[id],
+            (unsigned long long)st->gen_pieces[id]);
+  fprintf(stderr, "\n  gen_legals calls:");
+  for (int k = 0; k < 3; ++k)
+    fprintf(stderr, " %s %llu", gen_kind_names[k],
+            (unsigned long long)st->gen_calls[k]);
+  fprintf(stderr, "\n  is_attacked calls: %llu\n",
+          (unsigned long long)st->is_attacked);
+  fprintf(stderr, "  is_legal_move: %llu tested, %.1f%% rejected\n",
+          (unsigned long long)st->legality_tests,
+          stats_pct(st->legality_rejects, st->legality_tests));
+  fprintf(stderr, "  hash moves: %llu tested, %.1f%% rejected\n",
+          (unsigned long long)st->tt_move_tests,
+          stats_pct(st->tt_move_rejects, st->tt_move_tests));
+  fprintf(stderr, "  tt probes: %llu, %.1f%% hits\n",
+          (unsigned long long)st->tt_probes,
+          stats_pct(st->tt_hits, st->tt_probes));
+  fprintf(stderr, "  nodes: %llu, %.1f%% in quiescence\n",
+          (unsigned long long)(st->nodes + st->qnodes),
+          stats_pct(st->qnodes, st->nodes + st->qnodes));
+  fprintf(stderr, "  beta cutoffs: %llu, %.1f%% on the first move\n",
+          (unsigned long long)st->cutoffs,
+          stats_pct(st->first_move_cutoffs, st->cutoffs));
+  for (int t = 0; t < TIMER_COUNT; ++t)
+    fprintf(stderr, "  %-10s %12llu calls %8.1f cycles/call\n", timer_names[t],
+            (unsigned long long)st->timer_calls[t],
+            st->timer_calls[t]
+                ? (double)st->timer_cycles[t] / (double)st->timer_calls[t]
+                : 0.0);
+}
+
+#else
+
+#define STAT_INC(field) ((void)0)
+#define STAT_ADD(field, n) ((void)0)
+#define STAT_TIMER_START(t) ((void)0)
+#define STAT_TIMER_STOP(t) ((void)0)
+
+static inline void stats_flush(void) {}
+
+#endif
+
 /* =========================
    Indexing
    ========================= */
@@ -63,18 +295,233 @@ static inline u8 sq_idx(const char s[2]) {
   return v2_idx((v2){(u8)(s[0] - 'a'), (u8)(s[1] - '1')});
 }
 
+static inline v2 idx_v2(u8 sq) { return (v2){sq % WIDTH, sq / WIDTH}; }
+
 static inline bool v2_in_bounds(v2 p) { return p.x < WIDTH && p.y < HEIGHT; }
 
 /* =========================
-   FEN parsing
+   Bitboards
    ========================= */
 
-#define PAWN 1
-#define KNIGHT 2
-#define BISHOP 3
-#define ROOK 4
-#define QUEEN 5
-#define KING 6
+#define BB(sq) (1ULL << (sq))
+
+#define FILE_A 0x0101010101010101ULL
+#define FILE_B (FILE_A << 1)
+#define FILE_G (FILE_A << 6)
+#define FILE_H (FILE_A << 7)
+#define RANK_1 0xFFULL
+#define RANK_2 (RANK_1 << 8)
+#define RANK_3 (RANK_1 << 16)
+#define RANK_6 (RANK_1 << 40)
+#define RANK_7 (RANK_1 << 48)
+#define RANK_8 (RANK_1 << 56)
+
+// For routines written once against a colour parameter: inlined into a
+// caller passing WHITE or BLACK, every colour test folds away, leaving one
+// branch-free copy per colour
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+// Pawn moves for colour c: one rank forward, and forward diagonally
+// towards the a-file (west) and the h-file (east). The matching deltas
+// give the origin of a target square.
+ALWAYS_INLINE u64 pawn_up(u64 b, bool c) {
+  return c == WHITE ? b << 8 : b >> 8;
+}
+ALWAYS_INLINE u64 pawn_up_west(u64 b, bool c) {
+  return c == WHITE ? (b & ~FILE_A) << 7 : (b & ~FILE_A) >> 9;
+}
+ALWAYS_INLINE u64 pawn_up_east(u64 b, bool c) {
+  return c == WHITE ? (b & ~FILE_H) << 9 : (b & ~FILE_H) >> 7;
+}
+ALWAYS_INLINE int pawn_up_delta(bool c) { return c == WHITE ? 8 : -8; }
+ALWAYS_INLINE int pawn_west_delta(bool c) { return c == WHITE ? 7 : -9; }
+ALWAYS_INLINE int pawn_east_delta(bool c) { return c == WHITE ? 9 : -7; }
+
+static inline int popcount(u64 bb) { return __builtin_popcountll(bb); }
+
+// Index of the least significant set bit, bb must not be empty.
+static inline u8 bitscan(u64 bb) { return (u8)__builtin_ctzll(bb); }
+
+static inline u8 pop_lsb(u64 *bb) {
+  u8 sq = bitscan(*bb);
+  *bb &= *bb - 1;
+  return sq;
+}
+
+/* =========================
+   Zobrist keys
+   ========================= */
+
+// xorshift64*, deterministic so tables are identical on every run
+static inline u64 rand64(u64 *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+static u64 zobrist_piece[2][KING + 1][WIDTH * HEIGHT];
+static u64 zobrist_castling[16];
+static u64 zobrist_ep[WIDTH]; // by file
+static u64 zobrist_side;      // xored in when black is to move
+
+// Must run once before any board is set up
+void init_zobrist(void) {
+  u64 seed = 0x5348415241ULL;
+  for (int c = 0; c < 2; ++c)
+    for (int id = PAWN; id <= KING; ++id)
+      for (int sq = 0; sq < WIDTH * HEIGHT; ++sq)
+        zobrist_piece[c][id][sq] = rand64(&seed);
+  for (int i = 0; i < 16; ++i)
+    zobrist_castling[i] = rand64(&seed);
+  for (int x = 0; x < WIDTH; ++x)
+    zobrist_ep[x] = rand64(&seed);
+  zobrist_side = rand64(&seed);
+}
+
+/* =========================
+   Piece-square tables
+   ========================= */
+
+// Tables are laid out as the board is printed: a8 first, h1 last
+static const i8 pawn_mg[64] = {
+    0,  0,  0,   0,   0,   0,   0,  0,  50, 50, 50,  50, 50, 50,  50, 50,
+    10, 10, 20,  30,  30,  20,  10, 10, 5,  5,  10,  25, 25, 10,  5,  5,
+    0,  0,  0,   20,  20,  0,   0,  0,  5,  -5, -10, 0,  0,  -10, -5, 5,
+    5,  10, 10,  -20, -20, 10,  10, 5,  0,  0,  0,   0,  0,  0,   0,  0};
+static const i8 pawn_eg[64] = {
+    0,  0,  0,  0,  0,  0,  0,  0,  80, 80, 80, 80, 80, 80, 80, 80,
+    50, 50, 50, 50, 50, 50, 50, 50, 30, 30, 30, 30, 30, 30, 30, 30,
+    15, 15, 15, 15, 15, 15, 15, 15, 5,  5,  5,  5,  5,  5,  5,  5,
+    0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0};
+static const i8 knight_pst[64] = {
+    -50, -40, -30, -30, -30, -30, -40, -50, -40, -20, 0,   0,   0,
+    0,   -20, -40, -30, 0,   10,  15,  15,  10,  0,   -30, -30, 5,
+    15,  20,  20,  15,  5,   -30, -30, 0,   15,  20,  20,  15,  0,
+    -30, -30, 5,   10,  15,  15,  10,  5,   -30, -40, -20, 0,   5,
+    5,   0,   -20, -40, -50, -40, -30, -30, -30, -30, -40, -50};
+static const i8 bishop_pst[64] = {
+    -20, -10, -10, -10, -10, -10, -10, -20, -10, 0,   0,   0,   0,
+    0,   0,   -10, -10, 0,   5,   10,  10,  5,   0,   -10, -10, 5,
+    5,   10,  10,  5,   5,   -10, -10, 0,   10,  10,  10,  10,  0,
+    -10, -10, 10,  10,  10,  10,  10,  10,  -10, -10, 5,   0,   0,
+    0,   0,   5,   -10, -20, -10, -10, -10, -10, -10, -10, -20};
+static const i8 rook_pst[64] = {
+    0,  0,  0,  0,  0,  0,  0,  0,  5,  10, 10, 10, 10, 10, 10, 5,
+    -5, 0,  0,  0,  0,  0,  0,  -5, -5, 0,  0,  0,  0,  0,  0,  -5,
+    -5, 0,  0,  0,  0,  0,  0,  -5, -5, 0,  0,  0,  0,  0,  0,  -5,
+    -5, 0,  0,  0,  0,  0,  0,  -5, 0,  0,  0,  5,  5,  0,  0,  0};
+static const i8 queen_pst[64] = {
+    -20, -10, -10, -5, -5, -10, -10, -20, -10, 0,   0,   0,  0,  0,   0,   -10,
+    -10, 0,   5,   5,  5,  5,   0,   -10, -5,  0,   5,   5,  5,  5,   0,   -5,
+    0,   0,   5,   5,  5,  5,   0,   -5,  -10, 5,   5,   5,  5,  5,   0,   -10,
+    -10, 0,   5,   0,  0,  0,   0,   -10, -20, -10, -10, -5, -5, -10, -10, -20};
+static const i8 king_mg[64] = {
+    -30, -40, -40, -50, -50, -40, -40, -30, -30, -40, -40, -50, -50,
+    -40, -40, -30, -30, -40, -40, -50, -50, -40, -40, -30, -30, -40,
+    -40, -50, -50, -40, -40, -30, -20, -30, -30, -40, -40, -30, -30,
+    -20, -10, -20, -20, -20, -20, -20, -20, -10, 20,  20,  0,   0,
+    0,   0,   20,  20,  20,  30,  10,  0,   0,   10,  30,  20};
+static const i8 king_eg[64] = {
+    -50, -40, -30, -20, -20, -30, -40, -50, -30, -20, -10, 0,   0,
+    -10, -20, -30, -30, -10, 20,  30,  30,  20,  -10, -30, -30, -10,
+    30,  40,  40,  30,  -10, -30, -30, -10, 30,  40,  40,  30,  -10,
+    -30, -30, -10, 20,  30,  30,  20,  -10, -30, -30, -30, 0,   0,
+    0,   0,   -30, -30, -50, -30, -30, -30, -30, -30, -30, -50};
+
+static const i8 *const pst_tables[2][KING + 1] = {
+    {NULL, pawn_mg, knight_pst, bishop_pst, rook_pst, queen_pst, king_mg},
+    {NULL, pawn_eg, knight_pst, bishop_pst, rook_pst, queen_pst, king_eg}};
+
+static const int material_mg[KING + 1] = {0, 82, 337, 365, 477, 1025, 0};
+static const int material_eg[KING + 1] = {0, 94, 281, 297, 512, 936, 0};
+
+#define PHASE_MAX 24
+static const u8 phase_inc[KING + 1] = {0, 0, 1, 1, 2, 4, 0};
+
+// Signed (white positive) material + table score per colour, piece and
+// square, for middlegame [0] and endgame [1]
+static i16 psq_score[2][2][KING + 1][WIDTH * HEIGHT];
+
+// Must run once before any board is set up
+void init_psq(void) {
+  for (int c = 0; c < 2; ++c)
+    for (int id = PAWN; id <= KING; ++id)
+      for (int sq = 0; sq < WIDTH * HEIGHT; ++sq) {
+        int idx = c == WHITE ? sq ^ 56 : sq; // flip ranks for white
+        int sign = c == WHITE ? 1 : -1;
+        psq_score[0][c][id][sq] =
+            (i16)(sign * (material_mg[id] + pst_tables[0][id][idx]));
+        psq_score[1][c][id][sq] =
+            (i16)(sign * (material_eg[id] + pst_tables[1][id][idx]));
+      }
+}
+
+/* =========================
+   Board access
+   ========================= */
+
+static inline piece_t piece_at(const board_t *bd, u8 sq) {
+  u8 code = bd->mailbox[sq];
+  return (piece_t){.id = code & 7, .color = code >> 3};
+}
+
+static inline void put_piece(board_t *bd, u8 sq, piece_t pc) {
+  u64 b = BB(sq);
+  bd->pieces[pc.id] |= b;
+  bd->colors[pc.color] |= b;
+  bd->occupied |= b;
+  bd->mailbox[sq] = pc.id | pc.color << 3;
+  bd->piece_count[pc.color][pc.id]++;
+  if (pc.id == KING)
+    bd->king_sq[pc.color] = sq;
+  bd->st.key ^= zobrist_piece[pc.color][pc.id][sq];
+  bd->psq[0] += psq_score[0][pc.color][pc.id][sq];
+  bd->psq[1] += psq_score[1][pc.color][pc.id][sq];
+  bd->phase += phase_inc[pc.id];
+}
+
+static inline void remove_piece(board_t *bd, u8 sq, piece_t pc) {
+  u64 b = BB(sq);
+  bd->pieces[pc.id] &= ~b;
+  bd->colors[pc.color] &= ~b;
+  bd->occupied &= ~b;
+  bd->mailbox[sq] = 0;
+  bd->piece_count[pc.color][pc.id]--;
+  if (pc.id == KING)
+    bd->king_sq[pc.color] = NO_SQUARE;
+  bd->st.key ^= zobrist_piece[pc.color][pc.id][sq];
+  bd->psq[0] -= psq_score[0][pc.color][pc.id][sq];
+  bd->psq[1] -= psq_score[1][pc.color][pc.id][sq];
+  bd->phase -= phase_inc[pc.id];
+}
+
+// Whether a pawn of `taker` could capture en passant onto ep. Only then is
+// the ep square set, so equal positions always get equal keys.
+static inline bool ep_capturable(const board_t *bd, u8 ep, bool taker) {
+  u64 victim = BB(taker == WHITE ? ep - 8 : ep + 8);
+  u64 beside = ((victim << 1) & ~FILE_A) | ((victim >> 1) & ~FILE_H);
+  return beside & bd->pieces[PAWN] & bd->colors[taker];
+}
+
+// Full recomputation of bd.st.key, for setup and debug checks
+u64 compute_key(const board_t *bd) {
+  u64 key = zobrist_castling[bd->st.castling];
+  for (u64 occ = bd->occupied; occ;) {
+    u8 sq = pop_lsb(&occ);
+    piece_t pc = piece_at(bd, sq);
+    key ^= zobrist_piece[pc.color][pc.id][sq];
+  }
+  if (bd->st.ep_square != NO_SQUARE)
+    key ^= zobrist_ep[bd->st.ep_square % WIDTH];
+  if (bd->next_to_move == BLACK)
+    key ^= zobrist_side;
+  return key;
+}
+
+/* =========================
+   FEN parsing
+   ========================= */
 
 #define PAWN_CH 'p'
 #define KNIGHT_CH 'n'
@@ -103,20 +550,39 @@ static u8 fen_piece_id(char c) {
   }
 }
 
-void init_board_from_fen(board_t *board, const char *fen) {
+// Parses all six fields: piece placement, side to move, castling rights,
+// en passant square, halfmove clock and fullmove number. Missing trailing
+// fields default to white, no castling, no ep, 0 and 1. EPD operations in
+// place of the two counters are ignored. False, with board unusable, if
+// the placement is not 8 ranks of 8 files, has more than one king a side
+// or a pawn on the first or last rank, the castling field is not a lone
+// '-' or made of KQkq, or the ep square is not behind a pawn that just
+// moved two.
+bool init_board_from_fen(board_t *board, const char *fen) {
   // Clear board
-  for (usize i = 0; i < WIDTH * HEIGHT; i++) {
-    board->handle[i].id = 0;
-    board->handle[i].color = 0;
-  }
+  memset(board->pieces, 0, sizeof(board->pieces));
+  memset(board->colors, 0, sizeof(board->colors));
+  board->occupied = 0;
+  memset(board->mailbox, 0, sizeof(board->mailbox));
+  memset(board->piece_count, 0, sizeof(board->piece_count));
+  board->king_sq[WHITE] = board->king_sq[BLACK] = NO_SQUARE;
+  board->psq[0] = board->psq[1] = 0;
+  board->phase = 0;
+  board->next_to_move = WHITE;
+  board->st.castling = 0;
+  board->st.ep_square = NO_SQUARE;
+  board->st.rule50 = 0;
 
   int x = 0;
   int y = 7; // start at rank 8 (FEN order)
 
-  for (const char *p = fen; *p && *p != ' '; p++) {
+  const char *p = fen;
+  for (; *p && *p != ' '; p++) {
     char c = *p;
 
     if (c == '/') {
+      if (x != WIDTH || y == 0)
+        return false;
       x = 0;
       y--;
       continue;
@@ -124,16 +590,90 @@ void init_board_from_fen(board_t *board, const char *fen) {
 
     if (c >= '1' && c <= '8') {
       x += c - '0';
+      if (x > WIDTH)
+        return false;
       continue;
     }
 
     u8 id = fen_piece_id(c);
-    if (id) {
-      board->handle[v2_idx((v2){(u8)x, (u8)y})] =
-          (piece_t){.id = id, .color = (c >= 'a')}; // lowercase = black
-      x++;
+    bool color = c >= 'a'; // lowercase = black
+    if (!id || x == WIDTH || (id == PAWN && (y == 0 || y == HEIGHT - 1)) ||
+        (id == KING && board->piece_count[color][KING]))
+      return false;
+    put_piece(board, v2_idx((v2){(u8)x, (u8)y}),
+              (piece_t){.id = id, .color = color});
+    x++;
+  }
+  if (x != WIDTH || y != 0)
+    return false;
+
+  // Side to move
+  while (*p == ' ')
+    p++;
+  if (*p) {
+    if (*p != 'w' && *p != 'b')
+      return false;
+    board->next_to_move = (*p++ == 'b');
+  }
+
+  // Castling rights
+  while (*p == ' ')
+    p++;
+  if (*p == '-' && (!p[1] || p[1] == ' '))
+    p++;
+  for (; *p && *p != ' '; p++) {
+    switch (*p) {
+    case 'K':
+      board->st.castling |= CASTLE_WK;
+      break;
+    case 'Q':
+      board->st.castling |= CASTLE_WQ;
+      break;
+    case 'k':
+      board->st.castling |= CASTLE_BK;
+      break;
+    case 'q':
+      board->st.castling |= CASTLE_BQ;
+      break;
+    default:
+      return false;
     }
   }
+
+  // En passant target square, on the 3rd or 6th rank behind an enemy pawn
+  while (*p == ' ')
+    p++;
+  if (p[0] >= 'a' && p[0] <= 'h' && p[1] >= '1' && p[1] <= '8') {
+    bool us = board->next_to_move;
+    u8 ep = sq_idx(p);
+    u8 victim = us == WHITE ? ep - 8 : ep + 8;
+    if (p[1] != (us == WHITE ? '6' : '3') || (board->occupied & BB(ep)) ||
+        !(board->pieces[PAWN] & board->colors[!us] & BB(victim)))
+      return false;
+    if (ep_capturable(board, ep, us))
+      board->st.ep_square = ep;
+  } else if (*p && *p != '-') {
+    return false;
+  }
+  while (*p && *p != ' ')
+    p++;
+
+  // Halfmove clock and fullmove number
+  char *end;
+  long halfmove = strtol(p, &end, 10), fullmove = 1;
+  if (end != p) {
+    board->st.rule50 = halfmove < 0 ? 0 : halfmove > 255 ? 255 : (u8)halfmove;
+    p = end;
+    fullmove = strtol(p, &end, 10);
+    if (end == p || fullmove < 1)
+      fullmove = 1;
+  }
+  if (fullmove > 30000)
+    fullmove = 30000;
+  board->st.ply = (u16)(2 * (fullmove - 1) + board->next_to_move);
+
+  board->st.key = compute_key(board);
+  return true;
 }
 
 /* =========================
@@ -163,203 +703,436 @@ char piece_to_ch(piece_t pc) {
 
 void print_pc(piece_t pc) { putchar(piece_to_ch(pc)); }
 
+// Longest FEN board_to_fen writes, with its terminating NUL
+#define FEN_MAX 96
+
+// The inverse of init_board_from_fen: bd as a six field FEN in buf.
+// Returns its length.
+usize board_to_fen(const board_t *bd, char buf[FEN_MAX]) {
+  char *p = buf;
+  for (int y = HEIGHT - 1; y >= 0; --y) {
+    int empty = 0;
+    for (int x = 0; x < WIDTH; ++x) {
+      piece_t pc = piece_at(bd, (u8)(y * WIDTH + x));
+      if (!pc.id) {
+        empty++;
+        continue;
+      }
+      if (empty)
+        *p++ = (char)('0' + empty);
+      empty = 0;
+      *p++ = piece_to_ch(pc);
+    }
+    if (empty)
+      *p++ = (char)('0' + empty);
+    if (y)
+      *p++ = '/';
+  }
+
+  *p++ = ' ';
+  *p++ = bd->next_to_move == WHITE ? 'w' : 'b';
+  *p++ = ' ';
+  if (!bd->st.castling)
+    *p++ = '-';
+  if (bd->st.castling & CASTLE_WK)
+    *p++ = 'K';
+  if (bd->st.castling & CASTLE_WQ)
+    *p++ = 'Q';
+  if (bd->st.castling & CASTLE_BK)
+    *p++ = 'k';
+  if (bd->st.castling & CASTLE_BQ)
+    *p++ = 'q';
+  *p++ = ' ';
+  if (bd->st.ep_square == NO_SQUARE) {
+    *p++ = '-';
+  } else {
+    *p++ = (char)('a' + bd->st.ep_square % WIDTH);
+    *p++ = (char)('1' + bd->st.ep_square / WIDTH);
+  }
+  p += sprintf(p, " %d %d", bd->st.rule50, bd->st.ply / 2 + 1);
+  return (usize)(p - buf);
+}
+
 // Forward declaration because print_bd uses is_check
-void print_bd(board_t bd);
+void print_bd(const board_t *bd);
 
 /* =========================
-   Move structures & dynamic arrays
+   Move structures & fixed-capacity lists
    ========================= */
 
-typedef struct move_t {
-  piece_t piece;
-  v2 current_pos;
-  v2 next_pos;
-} move_t;
+// A move in 16 bits: from | to << 6 | (promotion - KNIGHT) << 12 | kind.
+// The moving piece is read from the board when needed.
+typedef u16 move_t;
+
+#define MOVE_NONE 0 // a1a1, never a real move
 
+// Move kinds, the top two bits
+#define MOVE_NORMAL 0
+#define MOVE_PROMOTION (1 << 14)
+#define MOVE_EN_PASSANT (2 << 14)
+#define MOVE_CASTLING (3 << 14)
+
+static inline move_t encode_move(u8 from, u8 to, u16 kind) {
+  return (move_t)(from | to << 6 | kind);
+}
+
+static inline move_t encode_promotion(u8 from, u8 to, u8 promotion) {
+  return (move_t)(from | to << 6 | (promotion - KNIGHT) << 12 |
+                  MOVE_PROMOTION);
+}
+
+static inline u8 move_from(move_t mv) { return mv & 63; }
+static inline u8 move_to(move_t mv) { return (mv >> 6) & 63; }
+static inline u16 move_kind(move_t mv) { return mv & (3 << 14); }
+
+// Piece id a pawn promotes to, 0 otherwise
+static inline u8 move_promotion(move_t mv) {
+  return move_kind(mv) == MOVE_PROMOTION ? KNIGHT + ((mv >> 12) & 3) : 0;
+}
+
+// No legal chess position has more than 218 moves
+#define MAX_MOVES 256
+
+// Lives on the caller's stack, generators only ever fill it
 typedef struct move_list_t {
-  move_t *handle;
+  move_t handle[MAX_MOVES];
   usize size;
 } move_list_t;
 
-typedef struct positions_list_t {
-  v2 *handle;
-  usize size;
-} positions_list_t;
+// Enough state to take a move back with unmake_move
+typedef struct undo_t {
+  piece_t captured; // id 0 if the move was not a capture
+  pos_state_t st;   // state before the move
+} undo_t;
 
-#define append(arena, el)                                                      \
+#define append(list, el)                                                       \
   do {                                                                         \
-    void *tmp = realloc((arena).handle,                                        \
-                        ((arena).size + 1) * sizeof((arena).handle[0]));       \
-    ASSERT(tmp, "Out of memory");                                              \
-    (arena).handle = tmp;                                                      \
-    (arena).handle[(arena).size++] = (el);                                     \
+    ASSERT((list).size < MAX_MOVES, "Move list overflow");                     \
+    (list).handle[(list).size++] = (el);                                       \
   } while (0)
 
 /* =========================
-   Move generation (pseudo‑legal, no check / pin detection)
+   Attack sets
    ========================= */
 
-positions_list_t list_potentials_pawn(board_t bd, v2 piece_pos) {
-  positions_list_t ret = {0};
-  piece_t pc = bd.handle[v2_idx(piece_pos)];
-  int dir =
-      (pc.color == WHITE) ? 1 : -1; // white moves up (+y), black down (-y)
-
-  // One square forward
-  v2 one = {piece_pos.x, (u8)(piece_pos.y + dir)};
-  if (v2_in_bounds(one) && bd.handle[v2_idx(one)].id == 0) {
-    append(ret, one);
-    // Two squares forward from starting rank
-    if ((pc.color == WHITE && piece_pos.y == 1) ||
-        (pc.color == BLACK && piece_pos.y == 6)) {
-      v2 two = {piece_pos.x, (u8)(piece_pos.y + 2 * dir)};
-      if (v2_in_bounds(two) && bd.handle[v2_idx(two)].id == 0) {
-        append(ret, two);
-      }
-    }
-  }
+// Leaper attack masks as constant expressions of a single-bit board b, so
+// the tables below are filled in by the compiler
+#define KNIGHT_ATT(b)                                                          \
+  (((((b) >> 1 & ~FILE_H) | ((b) << 1 & ~FILE_A)) << 16) |                    \
+   ((((b) >> 1 & ~FILE_H) | ((b) << 1 & ~FILE_A)) >> 16) |                    \
+   ((((b) >> 2 & ~(FILE_G | FILE_H)) | ((b) << 2 & ~(FILE_A | FILE_B)))       \
+    << 8) |                                                                    \
+   ((((b) >> 2 & ~(FILE_G | FILE_H)) | ((b) << 2 & ~(FILE_A | FILE_B))) >> 8))
+#define KING_ROW(b) ((b) | ((b) << 1 & ~FILE_A) | ((b) >> 1 & ~FILE_H))
+#define KING_ATT(b)                                                            \
+  ((KING_ROW(b) | KING_ROW(b) << 8 | KING_ROW(b) >> 8) & ~(b))
+#define WPAWN_ATT(b) (((b) << 7 & ~FILE_H) | ((b) << 9 & ~FILE_A))
+#define BPAWN_ATT(b) (((b) >> 9 & ~FILE_H) | ((b) >> 7 & ~FILE_A))
 
-  // Captures left and right
-  v2 cap_l = {(u8)(piece_pos.x - 1), (u8)(piece_pos.y + dir)};
-  if (piece_pos.x > 0 && v2_in_bounds(cap_l)) {
-    piece_t target = bd.handle[v2_idx(cap_l)];
-    if (target.id != 0 && target.color != pc.color)
-      append(ret, cap_l);
-  }
+// Expand f(BB(sq)) for every square in index order
+#define SQ8(f, r)                                                              \
+  f(BB(8 * r + 0)), f(BB(8 * r + 1)), f(BB(8 * r + 2)), f(BB(8 * r + 3)),      \
+      f(BB(8 * r + 4)), f(BB(8 * r + 5)), f(BB(8 * r + 6)), f(BB(8 * r + 7))
+#define SQ64(f)                                                                \
+  SQ8(f, 0), SQ8(f, 1), SQ8(f, 2), SQ8(f, 3), SQ8(f, 4), SQ8(f, 5), SQ8(f, 6), \
+      SQ8(f, 7)
+
+static const u64 knight_table[WIDTH * HEIGHT] = {SQ64(KNIGHT_ATT)};
+static const u64 king_table[WIDTH * HEIGHT] = {SQ64(KING_ATT)};
+static const u64 pawn_table[2][WIDTH * HEIGHT] = {{SQ64(WPAWN_ATT)},
+                                                  {SQ64(BPAWN_ATT)}};
 
-  v2 cap_r = {(u8)(piece_pos.x + 1), (u8)(piece_pos.y + dir)};
-  if (piece_pos.x + 1 < WIDTH && v2_in_bounds(cap_r)) {
-    piece_t target = bd.handle[v2_idx(cap_r)];
-    if (target.id != 0 && target.color != pc.color)
-      append(ret, cap_r);
+u64 knight_attacks(u8 sq) { return knight_table[sq]; }
+
+u64 king_attacks(u8 sq) { return king_table[sq]; }
+
+// Squares attacked by a pawn of `color` standing on sq
+u64 pawn_attacks(u8 sq, bool color) { return pawn_table[color][sq]; }
+
+// Ray directions: N, S, E, W, NE, NW, SE, SW
+static const int ray_shift[8] = {8, -8, 1, -1, 9, 7, -7, -9};
+static const u64 ray_mask[8] = {~0ULL,   ~0ULL,   ~FILE_A, ~FILE_H,
+                                ~FILE_A, ~FILE_H, ~FILE_A, ~FILE_H};
+
+// Walk one ray from sq, stopping on (and including) the first blocker
+static u64 ray_attacks(u8 sq, u64 occ, int dir) {
+  u64 att = 0;
+  u64 b = BB(sq);
+  int s = ray_shift[dir];
+  while ((b = (s > 0 ? b << s : b >> -s) & ray_mask[dir])) {
+    att |= b;
+    if (b & occ)
+      break;
   }
+  return att;
+}
+
+static u64 rook_attacks_slow(u8 sq, u64 occ) {
+  return ray_attacks(sq, occ, 0) | ray_attacks(sq, occ, 1) |
+         ray_attacks(sq, occ, 2) | ray_attacks(sq, occ, 3);
+}
 
-  return ret;
+static u64 bishop_attacks_slow(u8 sq, u64 occ) {
+  return ray_attacks(sq, occ, 4) | ray_attacks(sq, occ, 5) |
+         ray_attacks(sq, occ, 6) | ray_attacks(sq, occ, 7);
 }
 
-positions_list_t list_potentials_knight(board_t bd, v2 piece_pos) {
-  positions_list_t ret = {0};
-  piece_t pc = bd.handle[v2_idx(piece_pos)];
+/* =========================
+   Magic bitboards for sliders
+   ========================= */
 
-  static const int dx[8] = {1, 2, 2, 1, -1, -2, -2, -1};
-  static const int dy[8] = {2, 1, -1, -2, -2, -1, 1, 2};
+typedef struct magic_t {
+  u64 mask;     // relevant blockers, board edges excluded
+  u64 magic;    // unused with PEXT
+  u64 *attacks; // this square's slice of the shared table
+  u8 shift;     // 64 - popcount(mask)
+} magic_t;
 
-  for (int i = 0; i < 8; ++i) {
-    int nx = piece_pos.x + dx[i];
-    int ny = piece_pos.y + dy[i];
-    if (nx < 0 || nx >= WIDTH || ny < 0 || ny >= HEIGHT)
-      continue;
+// Sum of 2^popcount(mask) over all squares
+static u64 rook_table[0x19000];
+static u64 bishop_table[0x1480];
+static magic_t rook_magics[WIDTH * HEIGHT];
+static magic_t bishop_magics[WIDTH * HEIGHT];
 
-    v2 to = {(u8)nx, (u8)ny};
-    piece_t target = bd.handle[v2_idx(to)];
-    if (target.id == 0 || target.color != pc.color)
-      append(ret, to);
-  }
-  return ret;
+static inline u32 magic_index(const magic_t *m, u64 occ) {
+#ifdef __BMI2__
+  return (u32)_pext_u64(occ, m->mask);
+#else
+  return (u32)(((occ & m->mask) * m->magic) >> m->shift);
+#endif
 }
 
-positions_list_t list_potentials_bishop(board_t bd, v2 piece_pos) {
-  positions_list_t ret = {0};
-  piece_t pc = bd.handle[v2_idx(piece_pos)];
-  static const int dx[4] = {1, 1, -1, -1};
-  static const int dy[4] = {1, -1, 1, -1};
+u64 rook_attacks(u8 sq, u64 occ) {
+  const magic_t *m = &rook_magics[sq];
+  return m->attacks[magic_index(m, occ)];
+}
 
-  for (int i = 0; i < 4; ++i) {
-    int nx = piece_pos.x + dx[i];
-    int ny = piece_pos.y + dy[i];
-    while (nx >= 0 && nx < WIDTH && ny >= 0 && ny < HEIGHT) {
-      v2 to = {(u8)nx, (u8)ny};
-      piece_t target = bd.handle[v2_idx(to)];
-      if (target.id == 0) {
-        append(ret, to);
-      } else {
-        if (target.color != pc.color)
-          append(ret, to);
-        break;
-      }
-      nx += dx[i];
-      ny += dy[i];
-    }
-  }
-  return ret;
+u64 bishop_attacks(u8 sq, u64 occ) {
+  const magic_t *m = &bishop_magics[sq];
+  return m->attacks[magic_index(m, occ)];
 }
 
-positions_list_t list_potentials_rook(board_t bd, v2 piece_pos) {
-  positions_list_t ret = {0};
-  piece_t pc = bd.handle[v2_idx(piece_pos)];
-  static const int dx[4] = {1, -1, 0, 0};
-  static const int dy[4] = {0, 0, 1, -1};
+// Fill magics and table for one slider type, searching magic numbers by
+// trial. Returns the number of table entries used.
+static usize init_magics(magic_t magics[], u64 *table,
+                         u64 (*slow)(u8 sq, u64 occ)) {
+  // Per-rank seeds known to find all magics after few candidates
+  static const u64 seeds[HEIGHT] = {728,   10316, 55013, 32803,
+                                    12281, 15100, 16645, 255};
+  static u64 occupancy[4096], reference[4096];
+  usize used = 0;
 
-  for (int i = 0; i < 4; ++i) {
-    int nx = piece_pos.x + dx[i];
-    int ny = piece_pos.y + dy[i];
-    while (nx >= 0 && nx < WIDTH && ny >= 0 && ny < HEIGHT) {
-      v2 to = {(u8)nx, (u8)ny};
-      piece_t target = bd.handle[v2_idx(to)];
-      if (target.id == 0) {
-        append(ret, to);
-      } else {
-        if (target.color != pc.color)
-          append(ret, to);
-        break;
+  for (u8 sq = 0; sq < WIDTH * HEIGHT; ++sq) {
+    u64 edges = ((RANK_1 | RANK_8) & ~(RANK_1 << (8 * (sq / WIDTH)))) |
+                ((FILE_A | FILE_H) & ~(FILE_A << (sq % WIDTH)));
+    magic_t *m = &magics[sq];
+    m->mask = slow(sq, 0) & ~edges;
+    m->shift = (u8)(64 - popcount(m->mask));
+    m->attacks = table + used;
+
+    // Carry-Rippler walk over every subset of the mask
+    usize size = 0;
+    u64 b = 0;
+    do {
+      occupancy[size] = b;
+      reference[size] = slow(sq, b);
+      size++;
+      b = (b - m->mask) & m->mask;
+    } while (b);
+    used += size;
+
+#ifdef __BMI2__
+    (void)seeds;
+    for (usize i = 0; i < size; ++i)
+      m->attacks[magic_index(m, occupancy[i])] = reference[i];
+#else
+    static u32 epoch[4096], cur_epoch;
+    u64 seed = seeds[sq / WIDTH];
+    for (usize i = 0; i < size;) {
+      do
+        m->magic = rand64(&seed) & rand64(&seed) & rand64(&seed);
+      while (popcount((m->mask * m->magic) >> 56) < 6);
+
+      // A magic is good if no two subsets with different attacks collide
+      cur_epoch++;
+      for (i = 0; i < size; ++i) {
+        u32 idx = magic_index(m, occupancy[i]);
+        if (epoch[idx] < cur_epoch) {
+          epoch[idx] = cur_epoch;
+          m->attacks[idx] = reference[i];
+        } else if (m->attacks[idx] != reference[i]) {
+          break;
+        }
       }
-      nx += dx[i];
-      ny += dy[i];
     }
+#endif
   }
-  return ret;
+  return used;
 }
 
-positions_list_t list_potentials_queen(board_t bd, v2 piece_pos) {
-  // Queen = bishop + rook
-  positions_list_t ret = {0};
-  piece_t pc = bd.handle[v2_idx(piece_pos)];
-  static const int dx[8] = {1, 1, 1, 0, 0, -1, -1, -1};
-  static const int dy[8] = {1, 0, -1, 1, -1, 1, 0, -1};
-
-  for (int i = 0; i < 8; ++i) {
-    int nx = piece_pos.x + dx[i];
-    int ny = piece_pos.y + dy[i];
-    while (nx >= 0 && nx < WIDTH && ny >= 0 && ny < HEIGHT) {
-      v2 to = {(u8)nx, (u8)ny};
-      piece_t target = bd.handle[v2_idx(to)];
-      if (target.id == 0) {
-        append(ret, to);
-      } else {
-        if (target.color != pc.color)
-          append(ret, to);
-        break;
+// For squares on a common rank, file or diagonal: the squares strictly
+// between them, and the whole line through both. 0 otherwise.
+static u64 between_bb[WIDTH * HEIGHT][WIDTH * HEIGHT];
+static u64 line_bb[WIDTH * HEIGHT][WIDTH * HEIGHT];
+
+// Must run once before any attack lookup
+void init_attacks(void) {
+  usize rooks = init_magics(rook_magics, rook_table, rook_attacks_slow);
+  usize bishops = init_magics(bishop_magics, bishop_table, bishop_attacks_slow);
+  ASSERT(rooks == sizeof(rook_table) / sizeof(rook_table[0]) &&
+             bishops == sizeof(bishop_table) / sizeof(bishop_table[0]),
+         "Slider table size mismatch");
+
+  for (u8 a = 0; a < WIDTH * HEIGHT; ++a) {
+    for (u8 b = 0; b < WIDTH * HEIGHT; ++b) {
+      if (a == b)
+        continue;
+      if (rook_attacks(a, 0) & BB(b)) {
+        between_bb[a][b] = rook_attacks(a, BB(b)) & rook_attacks(b, BB(a));
+        line_bb[a][b] =
+            (rook_attacks(a, 0) & rook_attacks(b, 0)) | BB(a) | BB(b);
+      } else if (bishop_attacks(a, 0) & BB(b)) {
+        between_bb[a][b] = bishop_attacks(a, BB(b)) & bishop_attacks(b, BB(a));
+        line_bb[a][b] =
+            (bishop_attacks(a, 0) & bishop_attacks(b, 0)) | BB(a) | BB(b);
       }
-      nx += dx[i];
-      ny += dy[i];
     }
   }
-  return ret;
 }
 
-positions_list_t list_potentials_king(board_t bd, v2 piece_pos) {
-  positions_list_t ret = {0};
-  piece_t pc = bd.handle[v2_idx(piece_pos)];
-  static const int dx[8] = {1, 1, 1, 0, 0, -1, -1, -1};
-  static const int dy[8] = {1, 0, -1, 1, -1, 1, 0, -1};
+/* =========================
+   Attacks on a board
+   ========================= */
+
+// Pieces of both colours attacking sq, with occ as the blockers
+u64 attackers_to(const board_t *bd, u8 sq, u64 occ) {
+  return (pawn_attacks(sq, BLACK) & bd->pieces[PAWN] & bd->colors[WHITE]) |
+         (pawn_attacks(sq, WHITE) & bd->pieces[PAWN] & bd->colors[BLACK]) |
+         (knight_attacks(sq) & bd->pieces[KNIGHT]) |
+         (king_attacks(sq) & bd->pieces[KING]) |
+         (rook_attacks(sq, occ) & (bd->pieces[ROOK] | bd->pieces[QUEEN])) |
+         (bishop_attacks(sq, occ) & (bd->pieces[BISHOP] | bd->pieces[QUEEN]));
+}
+
+// Every square attacked by color, with occ as the blockers
+ALWAYS_INLINE u64 attacked_squares_by(const board_t *bd, bool color,
+                                      u64 occ) {
+  u64 own = bd->colors[color];
+  u64 pawns = bd->pieces[PAWN] & own;
+  u64 att = pawn_up_west(pawns, color) | pawn_up_east(pawns, color);
 
-  for (int i = 0; i < 8; ++i) {
-    int nx = piece_pos.x + dx[i];
-    int ny = piece_pos.y + dy[i];
-    if (nx >= 0 && nx < WIDTH && ny >= 0 && ny < HEIGHT) {
-      v2 to = {(u8)nx, (u8)ny};
-      piece_t target = bd.handle[v2_idx(to)];
-      if (target.id == 0 || target.color != pc.color)
-        append(ret, to);
-    }
-  }
-  // Castling not implemented (special move)
-  return ret;
+  for (u64 b = bd->pieces[KNIGHT] & own; b;)
+    att |= knight_attacks(pop_lsb(&b));
+  for (u64 b = (bd->pieces[BISHOP] | bd->pieces[QUEEN]) & own; b;)
+    att |= bishop_attacks(pop_lsb(&b), occ);
+  for (u64 b = (bd->pieces[ROOK] | bd->pieces[QUEEN]) & own; b;)
+    att |= rook_attacks(pop_lsb(&b), occ);
+  if (bd->king_sq[color] != NO_SQUARE)
+    att |= king_attacks(bd->king_sq[color]);
+  return att;
+}
+
+u64 attacked_squares(const board_t *bd, bool color, u64 occ) {
+  return color == WHITE ? attacked_squares_by(bd, WHITE, occ)
+                        : attacked_squares_by(bd, BLACK, occ);
+}
+
+// Castling is encoded as the king moving two squares. The king may not
+// start on, pass or land on a square in danger.
+ALWAYS_INLINE u64 castling_targets(const board_t *bd, bool color,
+                                   u64 danger) {
+  u8 rights = bd->st.castling &
+              (color == WHITE ? CASTLE_WK | CASTLE_WQ : CASTLE_BK | CASTLE_BQ);
+  u8 home = color == WHITE ? 4 : 60; // e1 / e8
+  u64 rooks = bd->pieces[ROOK] & bd->colors[color];
+  u64 targets = 0;
+
+  if (!rights || !(bd->pieces[KING] & bd->colors[color] & BB(home)) ||
+      (danger & BB(home)))
+    return 0;
+  if ((rights & (CASTLE_WK | CASTLE_BK)) && (rooks & BB(home + 3)) &&
+      !((bd->occupied | danger) & (BB(home + 1) | BB(home + 2))))
+    targets |= BB(home + 2);
+  if ((rights & (CASTLE_WQ | CASTLE_BQ)) && (rooks & BB(home - 4)) &&
+      !(bd->occupied & (BB(home - 1) | BB(home - 2) | BB(home - 3))) &&
+      !(danger & (BB(home - 1) | BB(home - 2))))
+    targets |= BB(home - 2);
+  return targets;
+}
+
+// Single and double pushes of a pawn of `color` on sq
+ALWAYS_INLINE u64 pawn_pushes(u8 sq, bool color, u64 empty) {
+  // White moves up (+y), black down (-y)
+  u64 one = pawn_up(BB(sq), color) & empty;
+  return one | (pawn_up(one & (color == WHITE ? RANK_3 : RANK_6), color) &
+                empty);
+}
+
+/* =========================
+   Move generation (pseudo‑legal, no check / pin detection)
+   ========================= */
+
+// Each list_potentials_* returns the set of target squares as a bitboard
+
+u64 list_potentials_pawn(const board_t *bd, v2 piece_pos) {
+  STAT_INC(gen_pieces[PAWN]);
+  u8 sq = v2_idx(piece_pos);
+  piece_t pc = piece_at(bd, sq);
+
+  // One square forward, two from the starting rank if both are empty
+  u64 targets = pawn_pushes(sq, pc.color, ~bd->occupied);
+
+  // Captures left and right, including en passant
+  u64 victims = bd->colors[!pc.color];
+  if (bd->st.ep_square != NO_SQUARE)
+    victims |= BB(bd->st.ep_square);
+  targets |= pawn_attacks(sq, pc.color) & victims;
+  return targets;
+}
+
+u64 list_potentials_knight(const board_t *bd, v2 piece_pos) {
+  STAT_INC(gen_pieces[KNIGHT]);
+  u8 sq = v2_idx(piece_pos);
+  piece_t pc = piece_at(bd, sq);
+  return knight_attacks(sq) & ~bd->colors[pc.color];
+}
+
+u64 list_potentials_bishop(const board_t *bd, v2 piece_pos) {
+  STAT_INC(gen_pieces[BISHOP]);
+  u8 sq = v2_idx(piece_pos);
+  piece_t pc = piece_at(bd, sq);
+  return bishop_attacks(sq, bd->occupied) & ~bd->colors[pc.color];
+}
+
+u64 list_potentials_rook(const board_t *bd, v2 piece_pos) {
+  STAT_INC(gen_pieces[ROOK]);
+  u8 sq = v2_idx(piece_pos);
+  piece_t pc = piece_at(bd, sq);
+  return rook_attacks(sq, bd->occupied) & ~bd->colors[pc.color];
+}
+
+u64 list_potentials_queen(const board_t *bd, v2 piece_pos) {
+  STAT_INC(gen_pieces[QUEEN]);
+  // Queen = bishop + rook
+  u8 sq = v2_idx(piece_pos);
+  piece_t pc = piece_at(bd, sq);
+  u64 att = bishop_attacks(sq, bd->occupied) | rook_attacks(sq, bd->occupied);
+  return att & ~bd->colors[pc.color];
+}
+
+u64 list_potentials_king(const board_t *bd, v2 piece_pos) {
+  STAT_INC(gen_pieces[KING]);
+  u8 sq = v2_idx(piece_pos);
+  piece_t pc = piece_at(bd, sq);
+  u64 targets = king_attacks(sq) & ~bd->colors[pc.color];
+  if (bd->st.castling)
+    targets |= castling_targets(
+        bd, pc.color, attacked_squares(bd, !pc.color, bd->occupied));
+  return targets;
 }
 
-positions_list_t list_potentials(board_t bd, v2 piece_pos) {
-  positions_list_t null = {0};
-  switch (bd.handle[v2_idx(piece_pos)].id) {
+u64 list_potentials(const board_t *bd, v2 piece_pos) {
+  switch (piece_at(bd, v2_idx(piece_pos)).id) {
   case 1:
     return list_potentials_pawn(bd, piece_pos);
   case 2:
@@ -373,30 +1146,41 @@ positions_list_t list_potentials(board_t bd, v2 piece_pos) {
   case 6:
     return list_potentials_king(bd, piece_pos);
   default:
-    return null;
+    return 0;
   }
 }
 
-move_list_t list_pseudo_legals(board_t bd) {
-  move_list_t ret = {0};
-
-  for (int y = HEIGHT - 1; y >= 0; --y) {
-    for (int x = 0; x < WIDTH; ++x) {
-      v2 pos = {(u8)x, (u8)y};
-      piece_t pc = bd.handle[v2_idx(pos)];
-      if (pc.id == 0 || pc.color != bd.next_to_move)
+// Append one move per target square of pc on from, tagging en passant and
+// castling and expanding pawn promotions
+static void append_targets(move_list_t *out, const board_t *bd, piece_t pc,
+                           u8 from, u64 targets) {
+  while (targets) {
+    u8 to = pop_lsb(&targets);
+    u16 kind = MOVE_NORMAL;
+    if (pc.id == PAWN) {
+      if (to < 8 || to >= 56) {
+        for (u8 promo = QUEEN; promo >= KNIGHT; --promo)
+          append(*out, encode_promotion(from, to, promo));
         continue;
-
-      positions_list_t potentials = list_potentials(bd, pos);
-      for (usize i = 0; i < potentials.size; ++i) {
-        move_t m = {
-            .piece = pc, .current_pos = pos, .next_pos = potentials.handle[i]};
-        append(ret, m);
       }
-      free(potentials.handle); // clean up temporary list
+      if (to == bd->st.ep_square)
+        kind = MOVE_EN_PASSANT;
+    } else if (pc.id == KING && (to - from == 2 || from - to == 2)) {
+      kind = MOVE_CASTLING;
     }
+    append(*out, encode_move(from, to, kind));
+  }
+}
+
+// Fills out with every pseudo-legal move of the side to move
+void list_pseudo_legals(const board_t *bd, move_list_t *out) {
+  out->size = 0;
+
+  for (u64 own = bd->colors[bd->next_to_move]; own;) {
+    u8 sq = pop_lsb(&own);
+    append_targets(out, bd, piece_at(bd, sq), sq,
+                   list_potentials(bd, idx_v2(sq)));
   }
-  return ret;
 }
 
 /* =========================
@@ -409,31 +1193,94 @@ void v2_to_algebraic_buf(v2 pos, char buf[3]) {
   buf[2] = '\0';
 }
 
-void print_move(move_t m) {
-  char from[3], to[3];
-  v2_to_algebraic_buf(m.current_pos, from);
-  v2_to_algebraic_buf(m.next_pos, to);
-  printf("%c from %s to %s", piece_to_ch(m.piece), from, to);
+// The move_to_* serializers write into the caller's buffer, NUL
+// terminated, and return the length written; the print_* functions are
+// one fwrite of their output.
+
+// Longest move_to_str output, with its terminating NUL: "P from e7 to e8=Q"
+#define MOVE_STR_MAX 18
+
+// m as played on bd, which it must not have been made on yet
+usize move_to_str(const board_t *bd, move_t m, char buf[MOVE_STR_MAX]) {
+  piece_t pc = piece_at(bd, move_from(m));
+  char *p = buf;
+  *p++ = piece_to_ch(pc);
+  memcpy(p, " from ", 6);
+  v2_to_algebraic_buf(idx_v2(move_from(m)), p + 6);
+  memcpy(p + 8, " to ", 4);
+  v2_to_algebraic_buf(idx_v2(move_to(m)), p + 12);
+  p += 14;
+  if (move_promotion(m)) {
+    *p++ = '=';
+    *p++ = piece_to_ch((piece_t){move_promotion(m), pc.color});
+  }
+  *p = '\0';
+  return (usize)(p - buf);
+}
+
+void print_move(const board_t *bd, move_t m) {
+  char buf[MOVE_STR_MAX];
+  fwrite(buf, 1, move_to_str(bd, m, buf), stdout);
 }
 
-void print_move_list(move_list_t list) {
-  for (usize i = 0; i < list.size; ++i) {
-    print_move(list.handle[i]);
-    putchar('\n');
+// Long algebraic notation as used by UCI, e.g. e2e4 or e7e8q
+usize move_to_uci(move_t m, char buf[6]) {
+  v2_to_algebraic_buf(idx_v2(move_from(m)), buf);
+  v2_to_algebraic_buf(idx_v2(move_to(m)), buf + 2);
+  if (!move_promotion(m))
+    return 4;
+  buf[4] = id_ch(move_promotion(m));
+  buf[5] = '\0';
+  return 5;
+}
+
+void print_move_uci(move_t m) {
+  char buf[6];
+  fwrite(buf, 1, move_to_uci(m, buf), stdout);
+}
+
+// One move per line
+void print_move_list(const board_t *bd, const move_list_t *list) {
+  char buf[MAX_MOVES * MOVE_STR_MAX];
+  usize len = 0;
+  for (usize i = 0; i < list->size; ++i) {
+    len += move_to_str(bd, list->handle[i], buf + len);
+    buf[len++] = '\n';
   }
+  fwrite(buf, 1, len, stdout);
 }
 
 /* =========================
    Custom printf for chess types
    ========================= */
 
+// Output gathered for one fwrite, flushed early only if it gets full
+typedef struct out_buf_t {
+  char buf[8192];
+  usize len;
+} out_buf_t;
+
+// Room for n more bytes in out
+static char *out_reserve(out_buf_t *out, usize n) {
+  if (out->len + n > sizeof(out->buf)) {
+    fwrite(out->buf, 1, out->len, stdout);
+    out->len = 0;
+  }
+  return out->buf + out->len;
+}
+
+usize board_to_diagram(const board_t *bd, char *buf);
+#define DIAGRAM_MAX 192
+
 void mprintf(const char *fmt, ...) {
   va_list args;
   va_start(args, fmt);
+  out_buf_t out = {.len = 0};
 
   for (const char *p = fmt; *p; ++p) {
     if (*p != '%') {
-      putchar(*p);
+      *out_reserve(&out, 1) = *p;
+      out.len++;
       continue;
     }
 
@@ -443,54 +1290,65 @@ void mprintf(const char *fmt, ...) {
 
     switch (*p) {
     case '%':
-      putchar('%');
+      *out_reserve(&out, 1) = '%';
+      out.len++;
       break;
 
     case 'b': { // board_t*
       board_t *bd = va_arg(args, board_t *);
-      print_bd(*bd);
+      out.len += board_to_diagram(bd, out_reserve(&out, DIAGRAM_MAX));
       break;
     }
 
     case 'p': { // piece_t
       piece_t pc = va_arg(args, piece_t);
-      print_pc(pc);
+      *out_reserve(&out, 1) = piece_to_ch(pc);
+      out.len++;
       break;
     }
 
     case 'v': { // v2 as (x,y)
       v2 pos = va_arg(args, v2);
-      printf("(%d,%d)", pos.x, pos.y);
+      out.len += (usize)sprintf(out_reserve(&out, 12), "(%d,%d)", pos.x, pos.y);
       break;
     }
 
     case 'a': { // v2 as algebraic
       v2 pos = va_arg(args, v2);
-      char buf[3];
-      v2_to_algebraic_buf(pos, buf);
-      printf("%s", buf);
+      v2_to_algebraic_buf(pos, out_reserve(&out, 3));
+      out.len += 2;
       break;
     }
 
-    case 'm': { // move_t
-      move_t m = va_arg(args, move_t);
-      print_move(m);
+    case 'm': { // move_t, in UCI notation
+      move_t m = (move_t)va_arg(args, int);
+      out.len += move_to_uci(m, out_reserve(&out, 6));
       break;
     }
 
-    case 'l': { // move_list_t*
+    case 'l': { // board_t*, then a move_list_t* of moves on it
+      board_t *bd = va_arg(args, board_t *);
       move_list_t *list = va_arg(args, move_list_t *);
-      print_move_list(*list);
+      for (usize i = 0; i < list->size; ++i) {
+        char *dst = out_reserve(&out, MOVE_STR_MAX + 1);
+        usize len = move_to_str(bd, list->handle[i], dst);
+        dst[len] = '\n';
+        out.len += len + 1;
+      }
       break;
     }
 
-    default:
-      putchar('%');
-      putchar(*p);
+    default: {
+      char *dst = out_reserve(&out, 2);
+      dst[0] = '%';
+      dst[1] = *p;
+      out.len += 2;
       break;
     }
+    }
   }
 
+  fwrite(out.buf, 1, out.len, stdout);
   va_end(args);
 }
 
@@ -498,204 +1356,4151 @@ void mprintf(const char *fmt, ...) {
    Check detection and legal move filtering
    ========================= */
 
-bool is_attacked(board_t bd, v2 square, bool attacker_color) {
-  // Knight attacks
-  static const int knight_dx[8] = {1, 2, 2, 1, -1, -2, -2, -1};
-  static const int knight_dy[8] = {2, 1, -1, -2, -2, -1, 1, 2};
-  for (int i = 0; i < 8; ++i) {
-    int x = square.x + knight_dx[i];
-    int y = square.y + knight_dy[i];
-    if (x >= 0 && x < WIDTH && y >= 0 && y < HEIGHT) {
-      piece_t p = bd.handle[v2_idx((v2){(u8)x, (u8)y})];
-      if (p.id == KNIGHT && p.color == attacker_color)
-        return true;
-    }
-  }
-
-  // King attacks (adjacent squares)
-  static const int king_dx[8] = {1, 1, 1, 0, 0, -1, -1, -1};
-  static const int king_dy[8] = {1, 0, -1, 1, -1, 1, 0, -1};
-  for (int i = 0; i < 8; ++i) {
-    int x = square.x + king_dx[i];
-    int y = square.y + king_dy[i];
-    if (x >= 0 && x < WIDTH && y >= 0 && y < HEIGHT) {
-      piece_t p = bd.handle[v2_idx((v2){(u8)x, (u8)y})];
-      if (p.id == KING && p.color == attacker_color)
-        return true;
-    }
-  }
+bool is_attacked(const board_t *bd, v2 square, bool attacker_color) {
+  STAT_INC(is_attacked);
+  u8 sq = v2_idx(square);
+  u64 them = bd->colors[attacker_color];
 
-  // Pawn attacks (depends on attacker's colour)
-  int pawn_dir = (attacker_color == WHITE) ? 1 : -1;
-  int pawn_att_y =
-      square.y - pawn_dir; // pawn stands one step behind attacked square
-  if (pawn_att_y >= 0 && pawn_att_y < HEIGHT) {
-    if (square.x > 0) {
-      v2 from = {(u8)(square.x - 1), (u8)pawn_att_y};
-      piece_t p = bd.handle[v2_idx(from)];
-      if (p.id == PAWN && p.color == attacker_color)
-        return true;
-    }
-    if (square.x + 1 < WIDTH) {
-      v2 from = {(u8)(square.x + 1), (u8)pawn_att_y};
-      piece_t p = bd.handle[v2_idx(from)];
-      if (p.id == PAWN && p.color == attacker_color)
-        return true;
-    }
-  }
+  // Leapers: look from the square outwards with the same pattern
+  if (knight_attacks(sq) & bd->pieces[KNIGHT] & them)
+    return true;
+  if (king_attacks(sq) & bd->pieces[KING] & them)
+    return true;
+  // A pawn attacks sq iff a pawn of the other colour on sq would attack it
+  if (pawn_attacks(sq, !attacker_color) & bd->pieces[PAWN] & them)
+    return true;
 
   // Sliding pieces: rook, bishop, queen
-  static const int slide_dx[8] = {0, 1, 0, -1, 1, 1, -1, -1};
-  static const int slide_dy[8] = {1, 0, -1, 0, 1, -1, -1, 1};
-  for (int d = 0; d < 8; ++d) {
-    int x = square.x + slide_dx[d];
-    int y = square.y + slide_dy[d];
-    while (x >= 0 && x < WIDTH && y >= 0 && y < HEIGHT) {
-      piece_t p = bd.handle[v2_idx((v2){(u8)x, (u8)y})];
-      if (p.id != 0) {
-        if (p.color == attacker_color) {
-          if (d < 4) { // orthogonal
-            if (p.id == ROOK || p.id == QUEEN)
-              return true;
-          } else { // diagonal
-            if (p.id == BISHOP || p.id == QUEEN)
-              return true;
-          }
-        }
-        break;
-      }
-      x += slide_dx[d];
-      y += slide_dy[d];
-    }
-  }
+  u64 queens = bd->pieces[QUEEN];
+  if (rook_attacks(sq, bd->occupied) & (bd->pieces[ROOK] | queens) & them)
+    return true;
+  if (bishop_attacks(sq, bd->occupied) & (bd->pieces[BISHOP] | queens) & them)
+    return true;
 
   return false;
 }
 
 // Find king of a specific colour
-u8 find_king_of_color(board_t bd, bool color) {
-  for (int i = 0; i < WIDTH * HEIGHT; ++i)
-    if (bd.handle[i].id == KING && bd.handle[i].color == color)
-      return i;
-  return UINT8_MAX;
+u8 find_king_of_color(const board_t *bd, bool color) {
+  return bd->king_sq[color];
 }
 
 // Check whether the side to move is in check
-bool is_check(board_t bd) {
-  u8 king_idx = find_king_of_color(bd, bd.next_to_move);
+bool is_check(const board_t *bd) {
+  u8 king_idx = find_king_of_color(bd, bd->next_to_move);
   ASSERT(king_idx != UINT8_MAX, "No king of side to move");
   v2 king_pos = {king_idx % WIDTH, king_idx / WIDTH};
-  return is_attacked(bd, king_pos, !bd.next_to_move);
+  return is_attacked(bd, king_pos, !bd->next_to_move);
 }
 
-// Apply a move (returns new board)
-board_t apply_move(board_t bd, move_t mv) {
-  ASSERT(v2_in_bounds(mv.next_pos), "Out of bounds");
-  bd.handle[v2_idx(mv.next_pos)] = bd.handle[v2_idx(mv.current_pos)];
-  bd.handle[v2_idx(mv.current_pos)].id = 0;
-  bd.handle[v2_idx(mv.current_pos)].color = 0;
-  bd.next_to_move = !bd.next_to_move;
+// Castling rights lost by any move from or to each square
+static const u8 castle_lost[WIDTH * HEIGHT] = {
+    [0] = CASTLE_WQ,                // a1
+    [4] = CASTLE_WK | CASTLE_WQ,    // e1
+    [7] = CASTLE_WK,                // h1
+    [56] = CASTLE_BQ,               // a8
+    [60] = CASTLE_BK | CASTLE_BQ,   // e8
+    [63] = CASTLE_BK,               // h8
+};
 
-  // Debug prints (optional)
-  putchar('\n');
+// Square of the pawn taken by an en passant capture landing on to
+static inline u8 ep_victim(u8 to, bool color) {
+  return color == WHITE ? to - 8 : to + 8;
+}
+
+// Play mv on bd in place, saving what unmake_move needs into undo
+void make_move(board_t *bd, move_t mv, undo_t *undo) {
+  u8 from = move_from(mv), to = move_to(mv);
+  piece_t pc = piece_at(bd, from);
+  ASSERT(pc.id, "No piece to move");
+  bool us = pc.color;
+  u16 kind = move_kind(mv);
+
+  undo->captured = piece_at(bd, to);
+  undo->st = bd->st;
+
+  if (undo->captured.id)
+    remove_piece(bd, to, undo->captured);
+  remove_piece(bd, from, pc);
+  put_piece(bd, to,
+            kind == MOVE_PROMOTION ? (piece_t){move_promotion(mv), us} : pc);
+
+  if (bd->st.ep_square != NO_SQUARE) {
+    bd->st.key ^= zobrist_ep[bd->st.ep_square % WIDTH];
+    bd->st.ep_square = NO_SQUARE;
+  }
+  if (kind == MOVE_EN_PASSANT) {
+    undo->captured = (piece_t){PAWN, !us};
+    remove_piece(bd, ep_victim(to, us), undo->captured);
+  } else if (pc.id == PAWN) {
+    if ((to - from == 16 || from - to == 16) &&
+        ep_capturable(bd, (from + to) / 2, !us)) {
+      bd->st.ep_square = (from + to) / 2;
+      bd->st.key ^= zobrist_ep[bd->st.ep_square % WIDTH];
+    }
+  } else if (kind == MOVE_CASTLING) {
+    // Castling: bring the rook over the king
+    piece_t rook = {ROOK, us};
+    u8 rook_from = to > from ? from + 3 : from - 4;
+    u8 rook_to = to > from ? from + 1 : from - 1;
+    remove_piece(bd, rook_from, rook);
+    put_piece(bd, rook_to, rook);
+  }
+
+  bd->st.key ^= zobrist_castling[bd->st.castling];
+  bd->st.castling &= ~(castle_lost[from] | castle_lost[to]);
+  bd->st.key ^= zobrist_castling[bd->st.castling] ^ zobrist_side;
+  bd->next_to_move = !bd->next_to_move;
+  if (pc.id == PAWN || undo->captured.id)
+    bd->st.rule50 = 0;
+  else if (bd->st.rule50 < UINT8_MAX)
+    bd->st.rule50++;
+  bd->st.ply++;
+
+#ifdef DEBUG_MOVES
+  ASSERT(bd->st.key == compute_key(bd), "Incremental key out of sync");
+  putchar('\n');
   putchar('\n');
   print_bd(bd);
   putchar('\n');
   putchar('\n');
+#endif
+}
+
+// Take back mv, which must be the last move made on bd
+void unmake_move(board_t *bd, move_t mv, const undo_t *undo) {
+  u8 from = move_from(mv), to = move_to(mv);
+  u16 kind = move_kind(mv);
+  piece_t moved = piece_at(bd, to);
+  bool us = moved.color;
+
+  remove_piece(bd, to, moved);
+  put_piece(bd, from, kind == MOVE_PROMOTION ? (piece_t){PAWN, us} : moved);
+
+  if (kind == MOVE_EN_PASSANT) {
+    put_piece(bd, ep_victim(to, us), undo->captured);
+  } else if (undo->captured.id) {
+    put_piece(bd, to, undo->captured);
+  } else if (kind == MOVE_CASTLING) {
+    piece_t rook = {ROOK, us};
+    u8 rook_from = to > from ? from + 3 : from - 4;
+    u8 rook_to = to > from ? from + 1 : from - 1;
+    remove_piece(bd, rook_to, rook);
+    put_piece(bd, rook_from, rook);
+  }
+
+  bd->next_to_move = !bd->next_to_move;
+  bd->st = undo->st;
+}
+
+// Pass the turn, for null move pruning
+void make_null_move(board_t *bd, undo_t *undo) {
+  undo->captured = (piece_t){0};
+  undo->st = bd->st;
+
+  if (bd->st.ep_square != NO_SQUARE) {
+    bd->st.key ^= zobrist_ep[bd->st.ep_square % WIDTH];
+    bd->st.ep_square = NO_SQUARE;
+  }
+  bd->st.key ^= zobrist_side;
+  bd->next_to_move = !bd->next_to_move;
+  if (bd->st.rule50 < UINT8_MAX)
+    bd->st.rule50++;
+  bd->st.ply++;
+}
+
+void unmake_null_move(board_t *bd, const undo_t *undo) {
+  bd->next_to_move = !bd->next_to_move;
+  bd->st = undo->st;
+}
+
+// Check whether a move is legal (does not leave own king in check).
+// bd is left unchanged on return.
+bool is_legal_move(board_t *bd, move_t mv) {
+  bool us = bd->next_to_move;
+  undo_t undo;
+  make_move(bd, mv, &undo);
+  u8 king_idx = find_king_of_color(bd, us);
+  ASSERT(king_idx != UINT8_MAX, "King missing after move");
+  v2 king_pos = {king_idx % WIDTH, king_idx / WIDTH};
+  bool opponent = !us;
+  bool legal = !is_attacked(bd, king_pos, opponent);
+  unmake_move(bd, mv, &undo);
+  STAT_INC(legality_tests);
+  STAT_ADD(legality_rejects, !legal);
+  return legal;
+}
+
+/* =========================
+   Legal move generation (checks and pins resolved up front)
+   ========================= */
+
+// Which legal moves gen_legals emits. Promotions count as captures, so a
+// capture-only pass sees everything that changes material.
+#define GEN_ALL 0
+#define GEN_CAPTURES 1 // captures, en passant and promotions
+#define GEN_QUIETS 2   // everything else, castling included
+
+// Pawn moves onto each target square from delta squares behind it
+static inline void append_pawn_moves(move_list_t *out, u64 targets,
+                                     int delta) {
+  while (targets) {
+    u8 to = pop_lsb(&targets);
+    append(*out, encode_move((u8)(to - delta), to, MOVE_NORMAL));
+  }
+}
+
+static inline void append_promotions(move_list_t *out, u64 targets,
+                                     int delta) {
+  while (targets) {
+    u8 to = pop_lsb(&targets);
+    for (u8 promo = QUEEN; promo >= KNIGHT; --promo)
+      append(*out, encode_promotion((u8)(to - delta), to, promo));
+  }
+}
+
+// Fills out with exactly the legal moves of the given kind for us, the side
+// to move. Checkers, pinned pieces and the squares the king may not step on
+// are computed once, so no candidate move has to be made and tested.
+// Instantiated once per colour by gen_legals.
+ALWAYS_INLINE void gen_legals_by(const board_t *bd, move_list_t *out,
+                                 int kind, bool us) {
+  out->size = 0;
+
+  u64 own = bd->colors[us], enemy = bd->colors[!us];
+  u8 ksq = find_king_of_color(bd, us);
+  ASSERT(ksq != UINT8_MAX, "No king of side to move");
+
+  u64 kind_mask = kind == GEN_CAPTURES ? enemy
+                  : kind == GEN_QUIETS ? ~bd->occupied
+                                       : ~own;
+  u64 promo_rank = us == WHITE ? RANK_8 : RANK_1;
+
+  // Sliders see through the king, so it cannot step back along a check ray
+  u64 danger = attacked_squares_by(bd, !us, bd->occupied ^ BB(ksq));
+  u64 checkers = attackers_to(bd, ksq, bd->occupied) & enemy;
+
+  u64 king_targets = king_attacks(ksq) & kind_mask & ~danger;
+  if (!checkers && bd->st.castling && kind != GEN_CAPTURES)
+    king_targets |= castling_targets(bd, us, danger);
+  append_targets(out, bd, (piece_t){KING, us}, ksq, king_targets);
+  STAT_INC(gen_pieces[KING]);
+
+  // Double check: only the king can move
+  if (popcount(checkers) > 1)
+    return;
+
+  // Single check: block the ray or capture the checker
+  u64 check_mask = ~0ULL;
+  if (checkers)
+    check_mask = between_bb[ksq][bitscan(checkers)] | checkers;
+
+  // A friendly piece alone between the king and an enemy slider is pinned
+  u64 pinned = 0;
+  u64 snipers =
+      ((rook_attacks(ksq, 0) & (bd->pieces[ROOK] | bd->pieces[QUEEN])) |
+       (bishop_attacks(ksq, 0) & (bd->pieces[BISHOP] | bd->pieces[QUEEN]))) &
+      enemy;
+  while (snipers) {
+    u64 blockers = between_bb[ksq][pop_lsb(&snipers)] & bd->occupied;
+    if (blockers && !(blockers & (blockers - 1)) && (blockers & own))
+      pinned |= blockers;
+  }
+
+  // Unpinned pawns all at once, by shifting the whole set
+  u64 pawns = bd->pieces[PAWN] & own & ~pinned;
+  STAT_ADD(gen_pieces[PAWN], popcount(bd->pieces[PAWN] & own));
+  u64 empty = ~bd->occupied;
+  u64 single = pawn_up(pawns, us) & empty;
+  u64 twice = pawn_up(single & (us == WHITE ? RANK_3 : RANK_6), us) & empty &
+              check_mask;
+  single &= check_mask;
+  u64 west = pawn_up_west(pawns, us) & enemy & check_mask;
+  u64 east = pawn_up_east(pawns, us) & enemy & check_mask;
+  if (kind != GEN_QUIETS) {
+    append_promotions(out, single & promo_rank, pawn_up_delta(us));
+    append_promotions(out, west & promo_rank, pawn_west_delta(us));
+    append_promotions(out, east & promo_rank, pawn_east_delta(us));
+    append_pawn_moves(out, west & ~promo_rank, pawn_west_delta(us));
+    append_pawn_moves(out, east & ~promo_rank, pawn_east_delta(us));
+  }
+  if (kind != GEN_CAPTURES) {
+    append_pawn_moves(out, single & ~promo_rank, pawn_up_delta(us));
+    append_pawn_moves(out, twice, 2 * pawn_up_delta(us));
+  }
+
+  // Pinned pawns one by one, along the pin line
+  for (u64 pinned_pawns = bd->pieces[PAWN] & own & pinned; pinned_pawns;) {
+    u8 sq = pop_lsb(&pinned_pawns);
+    u64 pushes = pawn_pushes(sq, us, empty);
+    u64 takes = pawn_attacks(sq, us) & enemy;
+    u64 targets;
+    if (kind == GEN_CAPTURES)
+      targets = takes | (pushes & promo_rank);
+    else if (kind == GEN_QUIETS)
+      targets = pushes & ~promo_rank;
+    else
+      targets = pushes | takes;
+    targets &= check_mask & line_bb[ksq][sq];
+    append_targets(out, bd, (piece_t){PAWN, us}, sq, targets);
+  }
+
+  for (u64 pieces = own & ~(bd->pieces[PAWN] | bd->pieces[KING]); pieces;) {
+    u8 sq = pop_lsb(&pieces);
+    u64 targets;
+    STAT_INC(gen_pieces[bd->mailbox[sq] & 7]);
+    switch (bd->mailbox[sq] & 7) {
+    case KNIGHT:
+      targets = knight_attacks(sq);
+      break;
+    case BISHOP:
+      targets = bishop_attacks(sq, bd->occupied);
+      break;
+    case ROOK:
+      targets = rook_attacks(sq, bd->occupied);
+      break;
+    default: // QUEEN
+      targets =
+          bishop_attacks(sq, bd->occupied) | rook_attacks(sq, bd->occupied);
+      break;
+    }
+    targets &= kind_mask & check_mask;
+    if (pinned & BB(sq))
+      targets &= line_bb[ksq][sq];
+    while (targets)
+      append(*out, encode_move(sq, pop_lsb(&targets), MOVE_NORMAL));
+  }
+
+  // En passant removes two pieces from one rank, which no pin mask covers,
+  // so test the resulting slider lines directly
+  if (bd->st.ep_square != NO_SQUARE && kind != GEN_QUIETS) {
+    u8 victim = ep_victim(bd->st.ep_square, us);
+    if (check_mask & (BB(bd->st.ep_square) | BB(victim))) {
+      u64 takers = pawn_attacks(bd->st.ep_square, !us) & bd->pieces[PAWN] & own;
+      while (takers) {
+        u8 from = pop_lsb(&takers);
+        u64 occ = (bd->occupied ^ BB(from) ^ BB(victim)) | BB(bd->st.ep_square);
+        u64 sliders =
+            (rook_attacks(ksq, occ) &
+             (bd->pieces[ROOK] | bd->pieces[QUEEN])) |
+            (bishop_attacks(ksq, occ) &
+             (bd->pieces[BISHOP] | bd->pieces[QUEEN]));
+        if (!(sliders & enemy))
+          append(*out, encode_move(from, bd->st.ep_square, MOVE_EN_PASSANT));
+      }
+    }
+  }
+}
+
+static void gen_legals(const board_t *bd, move_list_t *out, int kind) {
+  STAT_INC(gen_calls[kind]);
+  STAT_TIMER_START(TIMER_GEN_LEGALS);
+  if (bd->next_to_move == WHITE)
+    gen_legals_by(bd, out, kind, WHITE);
+  else
+    gen_legals_by(bd, out, kind, BLACK);
+  STAT_TIMER_STOP(TIMER_GEN_LEGALS);
+}
+
+// All legal moves of the side to move
+void list_legals(const board_t *bd, move_list_t *out) {
+  gen_legals(bd, out, GEN_ALL);
+}
+
+// Legal captures and promotions only
+void list_legal_captures(const board_t *bd, move_list_t *out) {
+  gen_legals(bd, out, GEN_CAPTURES);
+}
+
+// Legal moves that neither capture nor promote
+void list_legal_quiets(const board_t *bd, move_list_t *out) {
+  gen_legals(bd, out, GEN_QUIETS);
+}
+
+// Whether mv (e.g. a hash move of unknown origin) is legal in bd, without
+// generating any moves. bd is left unchanged.
+bool move_is_legal(board_t *bd, move_t mv) {
+  u8 from = move_from(mv), to = move_to(mv);
+  piece_t pc = piece_at(bd, from);
+  if (!pc.id || pc.color != bd->next_to_move ||
+      !(list_potentials(bd, idx_v2(from)) & BB(to)))
+    return false;
+  // The kind must be the one the generator would have given it
+  u16 kind = MOVE_NORMAL;
+  if (pc.id == PAWN && (to < 8 || to >= 56))
+    kind = MOVE_PROMOTION;
+  else if (pc.id == PAWN && to == bd->st.ep_square)
+    kind = MOVE_EN_PASSANT;
+  else if (pc.id == KING && (to - from == 2 || from - to == 2))
+    kind = MOVE_CASTLING;
+  if (move_kind(mv) != kind ||
+      (kind != MOVE_PROMOTION && (mv >> 12) & 3))
+    return false;
+  return is_legal_move(bd, mv);
+}
+
+// Board diagram into buf (DIAGRAM_MAX bytes), rank 8 first, with a king
+// in check shown in red. Either side's king may be the one in check, for
+// boards set up by hand. Returns its length.
+usize board_to_diagram(const board_t *bd, char *buf) {
+  u64 checked = 0;
+  for (int c = WHITE; c <= BLACK; ++c)
+    if (bd->king_sq[c] != NO_SQUARE &&
+        (attackers_to(bd, bd->king_sq[c], bd->occupied) & bd->colors[!c]))
+      checked |= BB(bd->king_sq[c]);
+
+  char *p = buf;
+  if (checked) {
+    memcpy(p, "IN CHECK!!\n", 11);
+    p += 11;
+  }
+  for (int y = HEIGHT - 1; y >= 0; --y) {
+    for (int x = 0; x < WIDTH; ++x) {
+      u8 sq = (u8)(y * WIDTH + x);
+      if (checked & BB(sq)) {
+        p += sprintf(p, "\033[31m%c\033[0m ", piece_to_ch(piece_at(bd, sq)));
+      } else {
+        *p++ = piece_to_ch(piece_at(bd, sq));
+        *p++ = ' ';
+      }
+    }
+    *p++ = '\n';
+  }
+  *p = '\0';
+  return (usize)(p - buf);
+}
+
+void print_bd(const board_t *bd) {
+  char buf[DIAGRAM_MAX];
+  fwrite(buf, 1, board_to_diagram(bd, buf), stdout);
+}
+
+/* =========================
+   Transposition table
+   ========================= */
+
+#define BOUND_NONE 0
+#define BOUND_UPPER 1 // failed low, true score is at most this
+#define BOUND_LOWER 2 // failed high, true score is at least this
+#define BOUND_EXACT 3
+
+// 16 bytes. check holds key ^ data, so an entry torn by a concurrent write
+// from another thread fails verification instead of needing a lock.
+typedef struct tt_entry_t {
+  _Atomic u64 check;
+  _Atomic u64 data; // move:16 score:16 eval:16 depth:8 bound:2 generation:6
+} tt_entry_t;
+
+#define TT_BUCKET_SIZE 4
+// A same-position store from the current search that is not exact replaces
+// the entry only if it is at most this much shallower
+#define TT_DEPTH_MARGIN 3
+
+// One cache line
+typedef struct tt_bucket_t {
+  _Alignas(64) tt_entry_t entries[TT_BUCKET_SIZE];
+} tt_bucket_t;
+
+typedef struct tt_data_t {
+  move_t move;
+  i16 score;
+  i16 eval;
+  u8 depth;
+  u8 bound;
+} tt_data_t;
+
+typedef struct tt_t {
+  tt_bucket_t *buckets;
+  usize count;
+  usize bytes; // mapped size, for munmap
+  // Bumped per search so old entries age out; the low 6 bits are stored.
+  _Atomic u8 generation;
+} tt_t;
+
+// The table the Lazy SMP pool and the batch searches share. Match engines
+// each have their own.
+static tt_t tt;
+
+void tt_clear(tt_t *table) {
+  memset(table->buckets, 0, table->count * sizeof(tt_bucket_t));
+  atomic_store_explicit(&table->generation, 0, memory_order_relaxed);
+}
+
+void tt_free(tt_t *table) {
+  if (table->buckets)
+    munmap(table->buckets, table->bytes);
+  table->buckets = NULL;
+  table->count = 0;
+}
+
+// (Re)allocate the table with mb megabytes. With huge_pages, try explicit
+// huge pages first and fall back to transparent huge page advice.
+void tt_init(tt_t *table, usize mb, bool huge_pages) {
+  tt_free(table);
+
+  const usize huge = 2 * 1024 * 1024;
+  usize bytes = mb * 1024 * 1024;
+  ASSERT(bytes >= sizeof(tt_bucket_t), "Hash size too small");
+  void *mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (huge_pages) {
+    bytes = (bytes + huge - 1) / huge * huge;
+    mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+#endif
+  if (mem == MAP_FAILED) {
+    mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT(mem != MAP_FAILED, "Out of memory");
+#ifdef MADV_HUGEPAGE
+    if (huge_pages)
+      madvise(mem, bytes, MADV_HUGEPAGE);
+#endif
+  }
+
+  table->buckets = mem; // anonymous mappings come zeroed
+  table->bytes = bytes;
+  table->count = bytes / sizeof(tt_bucket_t);
+  atomic_store_explicit(&table->generation, 0, memory_order_relaxed);
+}
+
+// Call once per search, before any store. Concurrent searches each bump it.
+void tt_new_search(tt_t *table) {
+  atomic_fetch_add_explicit(&table->generation, 1, memory_order_relaxed);
+}
+
+static inline u8 tt_generation(const tt_t *table) {
+  return atomic_load_explicit(&table->generation, memory_order_relaxed) & 63;
+}
+
+static inline tt_bucket_t *tt_bucket(const tt_t *table, u64 key) {
+  // Maps the key onto [0, count) without needing a power of two
+  return &table->buckets[(u64)(((unsigned __int128)key * table->count) >>
+                               64)];
+}
+
+// Start loading the bucket for key before it is probed
+static inline void tt_prefetch(const tt_t *table, u64 key) {
+  __builtin_prefetch(tt_bucket(table, key));
+}
+
+bool tt_probe(const tt_t *table, u64 key, tt_data_t *out) {
+  STAT_INC(tt_probes);
+  tt_bucket_t *b = tt_bucket(table, key);
+  for (int i = 0; i < TT_BUCKET_SIZE; ++i) {
+    u64 data = atomic_load_explicit(&b->entries[i].data, memory_order_relaxed);
+    u64 check =
+        atomic_load_explicit(&b->entries[i].check, memory_order_relaxed);
+    if ((check ^ data) != key || !data)
+      continue;
+    out->move = (move_t)data;
+    out->score = (i16)(data >> 16);
+    out->eval = (i16)(data >> 32);
+    out->depth = (u8)(data >> 48);
+    out->bound = (data >> 56) & 3;
+    STAT_INC(tt_hits);
+    return true;
+  }
+  return false;
+}
+
+void tt_store(tt_t *table, u64 key, move_t move, i16 score, i16 eval, u8 depth,
+              u8 bound) {
+  u8 generation = tt_generation(table);
+  tt_bucket_t *b = tt_bucket(table, key);
+  tt_entry_t *replace = &b->entries[0];
+  int worst = INT32_MAX;
+
+  for (int i = 0; i < TT_BUCKET_SIZE; ++i) {
+    tt_entry_t *e = &b->entries[i];
+    u64 data = atomic_load_explicit(&e->data, memory_order_relaxed);
+    u64 check = atomic_load_explicit(&e->check, memory_order_relaxed);
+    if ((check ^ data) == key || !data) {
+      if ((check ^ data) == key) {
+        // Same position: a qsearch result must not wipe out a deep one
+        if (bound != BOUND_EXACT && (data >> 58) == generation &&
+            depth + TT_DEPTH_MARGIN < (u8)(data >> 48))
+          return;
+        // Keep the old move if we have none to offer
+        if (!move)
+          move = (move_t)data;
+      }
+      replace = e;
+      break;
+    }
+    // Prefer evicting shallow entries from older searches
+    int age = (generation - (int)(data >> 58)) & 63;
+    int value = (int)(u8)(data >> 48) - 8 * age;
+    if (value < worst) {
+      worst = value;
+      replace = e;
+    }
+  }
+
+  u64 data = (u64)move | (u64)(u16)score << 16 | (u64)(u16)eval << 32 |
+             (u64)depth << 48 | (u64)(bound & 3) << 56 |
+             (u64)generation << 58;
+  atomic_store_explicit(&replace->check, key ^ data, memory_order_relaxed);
+  atomic_store_explicit(&replace->data, data, memory_order_relaxed);
+}
+
+// Permille of the first 1000 entries written during this search
+int tt_hashfull(const tt_t *table) {
+  u8 generation = tt_generation(table);
+  usize n = table->count < 250 ? table->count : 250, used = 0;
+  for (usize i = 0; i < n; ++i)
+    for (int j = 0; j < TT_BUCKET_SIZE; ++j) {
+      u64 data = atomic_load_explicit(&table->buckets[i].entries[j].data,
+                                      memory_order_relaxed);
+      used += data && (data >> 58) == generation;
+    }
+  return n ? (int)(used * 1000 / (n * TT_BUCKET_SIZE)) : 0;
+}
+
+/* =========================
+   Evaluation
+   ========================= */
+
+static const int piece_value[KING + 1] = {0, 100, 320, 330, 500, 900, 0};
+
+// Material and piece-square score from the side to move's point of view,
+// blended between middlegame and endgame by the remaining material. Both
+// halves are kept up to date by put_piece/remove_piece, so this is O(1).
+int evaluate(const board_t *bd) {
+  int phase = bd->phase < PHASE_MAX ? bd->phase : PHASE_MAX; // promotions
+  int score = (bd->psq[0] * phase + bd->psq[1] * (PHASE_MAX - phase)) /
+              PHASE_MAX;
+  return bd->next_to_move == WHITE ? score : -score;
+}
+
+/* =========================
+   NNUE evaluation
+   ========================= */
+
+// A HalfKP network: for each side, every non-king piece is one input
+// feature, keyed by the square of that side's own king. Both halves of the
+// first layer (the accumulator) are updated incrementally as moves are
+// made, then clipped and fed to a single output neuron.
+//
+// Weights file, all little endian, loaded with mmap:
+//   char magic[8] "SHKNNUE1"
+//   u32 inputs    NNUE_INPUTS
+//   u32 hidden    NNUE_HIDDEN
+//   padding up to 64 bytes
+//   i16 ft_bias[NNUE_HIDDEN]
+//   i16 ft_weight[NNUE_INPUTS][NNUE_HIDDEN]
+//   i16 out_weight[2][NNUE_HIDDEN]   side to move half first
+//   i32 out_bias
+// First layer values are scaled by NNUE_QA, output weights by NNUE_QB.
+
+#define NNUE_INPUTS (64 * 641)
+#define NNUE_HIDDEN 256
+#define NNUE_HEADER 64
+#define NNUE_QA 255
+#define NNUE_QB 64
+#define NNUE_SCALE 400
+
+#if defined(__AVX512BW__)
+#define NNUE_SIMD "avx512"
+#elif defined(__AVX2__)
+#define NNUE_SIMD "avx2"
+#elif defined(__ARM_NEON)
+#define NNUE_SIMD "neon"
+#include <arm_neon.h>
+#else
+#define NNUE_SIMD "scalar"
+#endif
+
+typedef struct nnue_acc_t {
+  _Alignas(64) i16 v[2][NNUE_HIDDEN]; // by perspective
+} nnue_acc_t;
+
+static struct {
+  void *map;
+  usize map_size;
+  const i16 *ft_bias;
+  const i16 *ft_weight;
+  const i16 *out_weight;
+  i32 out_bias;
+} nnue;
+
+// Evaluator searches start with, switched at runtime by nnue_load
+static bool use_nnue = false;
+
+// Map a weights file and switch the search over to it. On failure the
+// previous evaluator stays in use.
+bool nnue_load(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+  struct stat st;
+  usize expect = NNUE_HEADER + sizeof(i16) * (NNUE_HIDDEN +
+                                             (usize)NNUE_INPUTS * NNUE_HIDDEN +
+                                             2 * NNUE_HIDDEN) +
+                 sizeof(i32);
+  if (fstat(fd, &st) < 0 || (usize)st.st_size != expect) {
+    fprintf(stderr, "%s: not a %d->%dx2->1 network\n", path, NNUE_INPUTS,
+            NNUE_HIDDEN);
+    close(fd);
+    return false;
+  }
+  u8 *map = mmap(NULL, expect, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror(path);
+    return false;
+  }
+  u32 dims[2];
+  memcpy(dims, map + 8, sizeof(dims));
+  if (memcmp(map, "SHKNNUE1", 8) || dims[0] != NNUE_INPUTS ||
+      dims[1] != NNUE_HIDDEN) {
+    fprintf(stderr, "%s: bad network header\n", path);
+    munmap(map, expect);
+    return false;
+  }
+
+  if (nnue.map)
+    munmap(nnue.map, nnue.map_size);
+  nnue.map = map;
+  nnue.map_size = expect;
+  nnue.ft_bias = (const i16 *)(map + NNUE_HEADER);
+  nnue.ft_weight = nnue.ft_bias + NNUE_HIDDEN;
+  nnue.out_weight = nnue.ft_weight + (usize)NNUE_INPUTS * NNUE_HIDDEN;
+  memcpy(&nnue.out_bias, nnue.out_weight + 2 * NNUE_HIDDEN, sizeof(i32));
+  use_nnue = true;
+  return true;
+}
+
+// Input feature of pc on sq, seen from side persp whose king is on ksq
+static inline usize nnue_feature(bool persp, u8 ksq, piece_t pc, u8 sq) {
+  if (persp == BLACK) { // mirror so both sides see their own king low
+    ksq ^= 56;
+    sq ^= 56;
+  }
+  usize kind = (pc.id - 1) * 2 + (pc.color != persp);
+  return (usize)ksq * 641 + 1 + kind * 64 + sq;
+}
+
+// dst = src + sum of the add rows - sum of the sub rows
+static void nnue_update_half(i16 *dst, const i16 *src, const usize *add,
+                             int n_add, const usize *sub, int n_sub) {
+#if defined(__AVX512BW__)
+  for (int i = 0; i < NNUE_HIDDEN; i += 32) {
+    __m512i v = _mm512_load_si512((const void *)(src + i));
+    for (int j = 0; j < n_add; ++j)
+      v = _mm512_add_epi16(v, _mm512_loadu_si512(
+                                  nnue.ft_weight + add[j] * NNUE_HIDDEN + i));
+    for (int j = 0; j < n_sub; ++j)
+      v = _mm512_sub_epi16(v, _mm512_loadu_si512(
+                                  nnue.ft_weight + sub[j] * NNUE_HIDDEN + i));
+    _mm512_store_si512((void *)(dst + i), v);
+  }
+#elif defined(__AVX2__)
+  for (int i = 0; i < NNUE_HIDDEN; i += 16) {
+    __m256i v = _mm256_load_si256((const __m256i *)(src + i));
+    for (int j = 0; j < n_add; ++j)
+      v = _mm256_add_epi16(
+          v, _mm256_loadu_si256((const __m256i *)(nnue.ft_weight +
+                                                   add[j] * NNUE_HIDDEN + i)));
+    for (int j = 0; j < n_sub; ++j)
+      v = _mm256_sub_epi16(
+          v, _mm256_loadu_si256((const __m256i *)(nnue.ft_weight +
+                                                   sub[j] * NNUE_HIDDEN + i)));
+    _mm256_store_si256((__m256i *)(dst + i), v);
+  }
+#elif defined(__ARM_NEON)
+  for (int i = 0; i < NNUE_HIDDEN; i += 8) {
+    int16x8_t v = vld1q_s16(src + i);
+    for (int j = 0; j < n_add; ++j)
+      v = vaddq_s16(v, vld1q_s16(nnue.ft_weight + add[j] * NNUE_HIDDEN + i));
+    for (int j = 0; j < n_sub; ++j)
+      v = vsubq_s16(v, vld1q_s16(nnue.ft_weight + sub[j] * NNUE_HIDDEN + i));
+    vst1q_s16(dst + i, v);
+  }
+#else
+  for (int i = 0; i < NNUE_HIDDEN; ++i) {
+    int v = src[i];
+    for (int j = 0; j < n_add; ++j)
+      v += nnue.ft_weight[add[j] * NNUE_HIDDEN + i];
+    for (int j = 0; j < n_sub; ++j)
+      v -= nnue.ft_weight[sub[j] * NNUE_HIDDEN + i];
+    dst[i] = (i16)v;
+  }
+#endif
+}
+
+// Rebuild one half of the accumulator from the pieces on the board
+static void nnue_refresh_half(const board_t *bd, nnue_acc_t *acc,
+                              bool persp) {
+  u8 ksq = bd->king_sq[persp];
+  memcpy(acc->v[persp], nnue.ft_bias, sizeof(acc->v[persp]));
+  u64 bb = bd->occupied & ~bd->pieces[KING];
+  while (bb) {
+    usize add[8];
+    int n = 0;
+    while (bb && n < 8) {
+      u8 sq = pop_lsb(&bb);
+      add[n++] = nnue_feature(persp, ksq, piece_at(bd, sq), sq);
+    }
+    nnue_update_half(acc->v[persp], acc->v[persp], add, n, NULL, 0);
+  }
+}
+
+void nnue_refresh(const board_t *bd, nnue_acc_t *acc) {
+  nnue_refresh_half(bd, acc, WHITE);
+  nnue_refresh_half(bd, acc, BLACK);
+}
+
+// Derive the accumulator after mv from the one before it. bd is the board
+// after make_move and undo what it saved. A king move invalidates every
+// feature of its own side, so that half is rebuilt instead.
+void nnue_make_move(const board_t *bd, nnue_acc_t *dst, const nnue_acc_t *src,
+                    move_t mv, const undo_t *undo) {
+  u8 from = move_from(mv), to = move_to(mv);
+  piece_t moved = piece_at(bd, to);
+  bool us = moved.color;
+  piece_t pc = move_kind(mv) == MOVE_PROMOTION ? (piece_t){PAWN, us} : moved;
+
+  // Piece changes as (piece, square) pairs, kings excluded
+  piece_t add_pc[2], sub_pc[2];
+  u8 add_sq[2], sub_sq[2];
+  int n_add = 0, n_sub = 0;
+  if (pc.id == KING) {
+    if (move_kind(mv) == MOVE_CASTLING) {
+      sub_pc[n_sub] = add_pc[n_add] = (piece_t){ROOK, us};
+      sub_sq[n_sub++] = to > from ? from + 3 : from - 4;
+      add_sq[n_add++] = to > from ? from + 1 : from - 1;
+    }
+  } else {
+    sub_pc[n_sub] = pc;
+    sub_sq[n_sub++] = from;
+    add_pc[n_add] = moved;
+    add_sq[n_add++] = to;
+  }
+  if (undo->captured.id) {
+    sub_pc[n_sub] = undo->captured;
+    sub_sq[n_sub++] =
+        move_kind(mv) == MOVE_EN_PASSANT ? ep_victim(to, us) : to;
+  }
+
+  for (int persp = 0; persp < 2; ++persp) {
+    if (pc.id == KING && persp == us) {
+      nnue_refresh_half(bd, dst, persp);
+      continue;
+    }
+    u8 ksq = bd->king_sq[persp];
+    usize add[2] = {0}, sub[3] = {0};
+    for (int i = 0; i < n_add; ++i)
+      add[i] = nnue_feature(persp, ksq, add_pc[i], add_sq[i]);
+    for (int i = 0; i < n_sub; ++i)
+      sub[i] = nnue_feature(persp, ksq, sub_pc[i], sub_sq[i]);
+    nnue_update_half(dst->v[persp], src->v[persp], add, n_add, sub, n_sub);
+  }
+}
+
+// Sum of clamp(acc, 0, NNUE_QA) * w over one half
+static i32 nnue_dot_half(const i16 *acc, const i16 *w) {
+#if defined(__AVX512BW__)
+  __m512i lo = _mm512_setzero_si512(), hi = _mm512_set1_epi16(NNUE_QA);
+  __m512i sum = _mm512_setzero_si512();
+  for (int i = 0; i < NNUE_HIDDEN; i += 32) {
+    __m512i v = _mm512_load_si512((const void *)(acc + i));
+    v = _mm512_min_epi16(_mm512_max_epi16(v, lo), hi);
+    sum = _mm512_add_epi32(
+        sum, _mm512_madd_epi16(v, _mm512_loadu_si512(w + i)));
+  }
+  return _mm512_reduce_add_epi32(sum);
+#elif defined(__AVX2__)
+  __m256i lo = _mm256_setzero_si256(), hi = _mm256_set1_epi16(NNUE_QA);
+  __m256i sum = _mm256_setzero_si256();
+  for (int i = 0; i < NNUE_HIDDEN; i += 16) {
+    __m256i v = _mm256_load_si256((const __m256i *)(acc + i));
+    v = _mm256_min_epi16(_mm256_max_epi16(v, lo), hi);
+    sum = _mm256_add_epi32(
+        sum,
+        _mm256_madd_epi16(v, _mm256_loadu_si256((const __m256i *)(w + i))));
+  }
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(sum),
+                            _mm256_extracti128_si256(sum, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+  return _mm_cvtsi128_si32(s);
+#elif defined(__ARM_NEON)
+  int16x8_t lo = vdupq_n_s16(0), hi = vdupq_n_s16(NNUE_QA);
+  int32x4_t sum = vdupq_n_s32(0);
+  for (int i = 0; i < NNUE_HIDDEN; i += 8) {
+    int16x8_t v = vminq_s16(vmaxq_s16(vld1q_s16(acc + i), lo), hi);
+    int16x8_t x = vld1q_s16(w + i);
+    sum = vmlal_s16(sum, vget_low_s16(v), vget_low_s16(x));
+    sum = vmlal_s16(sum, vget_high_s16(v), vget_high_s16(x));
+  }
+  return vaddvq_s32(sum);
+#else
+  i32 sum = 0;
+  for (int i = 0; i < NNUE_HIDDEN; ++i) {
+    int v = acc[i] < 0 ? 0 : acc[i] > NNUE_QA ? NNUE_QA : acc[i];
+    sum += v * w[i];
+  }
+  return sum;
+#endif
+}
+
+// Network output in centipawns from the side to move's point of view
+int nnue_evaluate(const board_t *bd, const nnue_acc_t *acc) {
+  bool us = bd->next_to_move;
+  i64 sum = (i64)nnue_dot_half(acc->v[us], nnue.out_weight) +
+            nnue_dot_half(acc->v[!us], nnue.out_weight + NNUE_HIDDEN) +
+            nnue.out_bias;
+  return (int)(sum * NNUE_SCALE / (NNUE_QA * NNUE_QB));
+}
+
+/* =========================
+   Static exchange evaluation
+   ========================= */
+
+// The king is worth more than anything it could win
+static const int see_value[KING + 1] = {0, 100, 320, 330, 500, 900, 20000};
+
+// Material outcome of mv for the mover if both sides keep recapturing on
+// the target square with their least valuable attacker, either side being
+// free to stop. Sliders uncovered behind a capturer join in as x-rays.
+int see(const board_t *bd, move_t mv) {
+  u8 from = move_from(mv), to = move_to(mv);
+  piece_t pc = piece_at(bd, from);
+  u8 promotion = move_promotion(mv);
+  u64 occ = bd->occupied ^ BB(from);
+  u64 diagonal = bd->pieces[BISHOP] | bd->pieces[QUEEN];
+  u64 straight = bd->pieces[ROOK] | bd->pieces[QUEEN];
+  int gain[32], d = 0;
+
+  u8 piece = promotion ? promotion : pc.id;
+  if (move_kind(mv) == MOVE_EN_PASSANT) {
+    occ ^= BB(ep_victim(to, pc.color));
+    gain[0] = see_value[PAWN];
+  } else {
+    gain[0] = see_value[piece_at(bd, to).id];
+  }
+  if (promotion)
+    gain[0] += see_value[promotion] - see_value[PAWN];
+
+  u64 attackers = attackers_to(bd, to, occ) & occ;
+  bool side = !pc.color;
+  for (;;) {
+    u64 ours = attackers & bd->colors[side];
+    if (!ours)
+      break;
+    u8 id = PAWN;
+    while (!(ours & bd->pieces[id]))
+      id++;
+    // The king may only take last
+    if (id == KING && (attackers & bd->colors[!side]))
+      break;
+
+    // What side gains by taking the piece that last moved here
+    d++;
+    gain[d] = see_value[piece] - gain[d - 1];
+
+    u64 b = ours & bd->pieces[id];
+    occ ^= b & -b;
+    attackers |= (bishop_attacks(to, occ) & diagonal) |
+                 (rook_attacks(to, occ) & straight);
+    attackers &= occ;
+    piece = id;
+    side = !side;
+  }
+
+  // Walk back: each side only takes if it does not lose by doing so
+  while (d) {
+    gain[d - 1] = -(-gain[d - 1] > gain[d] ? -gain[d - 1] : gain[d]);
+    d--;
+  }
+  return gain[0];
+}
+
+/* =========================
+   Endgame bitbase (KPK)
+   ========================= */
+
+// Won or drawn for king and pawn against king, for every placement, worked
+// out backwards from the positions whose result is plain. It is built on
+// the first probe. Positions are seen with the pawn side as white and the
+// pawn on files a-d; index bits: white king 0-5, black king 6-11, side to
+// move 12, pawn file 13-14, 7 - pawn rank 15-17.
+
+#define KPK_SIZE (2 * 24 * 64 * 64)
+
+enum { KPK_INVALID = 0, KPK_UNKNOWN = 1, KPK_DRAW = 2, KPK_WIN = 4 };
+
+static u64 kpk_bits[KPK_SIZE / 64]; // won for white
+static pthread_once_t kpk_once = PTHREAD_ONCE_INIT;
+
+static inline usize kpk_index(bool stm, u8 bksq, u8 wksq, u8 psq) {
+  return wksq | (usize)bksq << 6 | (usize)stm << 12 | (usize)(psq % 8) << 13 |
+         (usize)(6 - psq / 8) << 15;
+}
+
+static inline int square_distance(u8 a, u8 b) {
+  int dx = abs(a % 8 - b % 8), dy = abs(a / 8 - b / 8);
+  return dx > dy ? dx : dy;
+}
+
+// Result decided by the position alone, or KPK_UNKNOWN
+static u8 kpk_initial(usize idx) {
+  u8 wksq = idx & 63, bksq = (idx >> 6) & 63;
+  bool stm = (idx >> 12) & 1;
+  u8 psq = (u8)(8 * (6 - ((idx >> 15) & 7)) + ((idx >> 13) & 3));
+
+  // Two pieces on one square, or the side not to move in check
+  if (square_distance(wksq, bksq) <= 1 || wksq == psq || bksq == psq ||
+      (stm == WHITE && (pawn_attacks(psq, WHITE) & BB(bksq))))
+    return KPK_INVALID;
+  // White promotes and the queen cannot be taken
+  if (stm == WHITE && psq / 8 == 6 && wksq != psq + 8 &&
+      (square_distance(bksq, psq + 8) > 1 ||
+       square_distance(wksq, psq + 8) == 1))
+    return KPK_WIN;
+  // Stalemate, or black takes the pawn
+  u64 guarded = king_attacks(wksq) | pawn_attacks(psq, WHITE);
+  if (stm == BLACK && (!(king_attacks(bksq) & ~guarded) ||
+                       (king_attacks(bksq) & ~king_attacks(wksq) & BB(psq))))
+    return KPK_DRAW;
+  return KPK_UNKNOWN;
+}
+
+// Combine the results after every move: a win for white if white can reach
+// one (or black cannot avoid one), a draw likewise for black
+static u8 kpk_classify(const u8 *db, usize idx) {
+  u8 wksq = idx & 63, bksq = (idx >> 6) & 63;
+  bool stm = (idx >> 12) & 1;
+  u8 psq = (u8)(8 * (6 - ((idx >> 15) & 7)) + ((idx >> 13) & 3));
+  u8 good = stm == WHITE ? KPK_WIN : KPK_DRAW;
+  u8 bad = stm == WHITE ? KPK_DRAW : KPK_WIN;
+
+  u8 r = KPK_INVALID;
+  for (u64 b = king_attacks(stm == WHITE ? wksq : bksq); b;) {
+    u8 to = pop_lsb(&b);
+    r |= stm == WHITE ? db[kpk_index(BLACK, bksq, to, psq)]
+                      : db[kpk_index(WHITE, to, wksq, psq)];
+  }
+  if (stm == WHITE) {
+    if (psq / 8 < 6) // pushes to the last rank are the initial wins
+      r |= db[kpk_index(BLACK, bksq, wksq, psq + 8)];
+    if (psq / 8 == 1 && psq + 8 != wksq && psq + 8 != bksq)
+      r |= db[kpk_index(BLACK, bksq, wksq, psq + 16)];
+  }
+  return r & good ? good : r & KPK_UNKNOWN ? KPK_UNKNOWN : bad;
+}
+
+static void kpk_init(void) {
+  u8 *db = malloc(KPK_SIZE);
+  ASSERT(db, "Out of memory for the KPK bitbase");
+  for (usize i = 0; i < KPK_SIZE; ++i)
+    db[i] = kpk_initial(i);
+
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (usize i = 0; i < KPK_SIZE; ++i)
+      if (db[i] == KPK_UNKNOWN && (db[i] = kpk_classify(db, i)) != KPK_UNKNOWN)
+        changed = true;
+  }
+
+  for (usize i = 0; i < KPK_SIZE; ++i)
+    if (db[i] == KPK_WIN)
+      kpk_bits[i / 64] |= BB(i % 64);
+  free(db);
+}
+
+// Whether the side with the pawn wins; bd must be king and pawn vs king
+bool kpk_win(const board_t *bd) {
+  pthread_once(&kpk_once, kpk_init);
+  bool strong = (bd->pieces[PAWN] & bd->colors[WHITE]) ? WHITE : BLACK;
+  u8 wksq = bd->king_sq[strong], bksq = bd->king_sq[!strong];
+  u8 psq = bitscan(bd->pieces[PAWN]);
+  bool stm = bd->next_to_move != strong;
+  if (strong == BLACK) { // flip the board so the pawn goes up
+    wksq ^= 56;
+    bksq ^= 56;
+    psq ^= 56;
+  }
+  if (psq % 8 >= 4) { // mirror onto files a-d
+    wksq ^= 7;
+    bksq ^= 7;
+    psq ^= 7;
+  }
+  usize idx = kpk_index(stm, bksq, wksq, psq);
+  return kpk_bits[idx / 64] & BB(idx % 64);
+}
+
+/* =========================
+   Search
+   ========================= */
+
+#define MAX_PLY 128
+#define VALUE_INF 32000
+#define VALUE_MATE 31000
+#define VALUE_MATE_IN_MAX (VALUE_MATE - MAX_PLY)
+#define VALUE_KNOWN_WIN 10000 // plus the winner's material, below mate scores
+
+#define DEFAULT_HASH_MB 16
+
+typedef struct pv_line_t {
+  move_t moves[MAX_PLY];
+  int size;
+} pv_line_t;
+
+typedef struct search_limits_t {
+  int depth;        // 0 = no limit
+  u64 nodes;        // 0 = no limit
+  double time;      // seconds, 0 = no limit
+  double soft_time; // no new iteration after this many seconds, 0 = none
+  bool infinite;    // keep going until stopped, even past the depth limit
+  bool quiet;       // no info lines
+} search_limits_t;
+
+#define HISTORY_MAX 16384
+
+// Hands out moves best first, generating each group only when the previous
+// one is exhausted: the hash move needs no generation at all, and quiet
+// moves are never generated at a node where a capture cuts off. Captures
+// that lose material by SEE wait until after the quiet moves.
+typedef struct move_picker_t {
+  move_list_t list;
+  int scores[MAX_MOVES];
+  usize next;
+  int stage;
+  bool captures_only; // quiescence: no quiets, losing captures dropped
+  move_t tt_move;
+  move_t counter; // countermove to the opponent's last move
+  const struct search_t *s;
+  int ply;
+  move_t bad[MAX_MOVES];
+  usize bad_size, bad_next;
+} move_picker_t;
+
+// What a node needs besides the board, one entry per ply in search_t, so
+// that a search only ever touches memory its thread set up front
+typedef struct search_stack_t {
+  move_picker_t mp;
+  undo_t undo;       // for the move being searched
+  pv_line_t pv;      // best line from this ply, filled by negamax
+  move_t played;     // move made at this ply, 0 for a null move
+  int quiets_size;
+  move_t quiets[64]; // quiet moves searched without a cutoff
+  int from_null;     // plies since the last null move, or the root
+} search_stack_t;
+
+// Positions before the root that a search must not repeat: keys of the
+// game since its last capture or pawn move, oldest first. Longer windows
+// than the fifty move rule are never needed.
+#define KEY_HISTORY_MAX 128
+
+typedef struct key_history_t {
+  u64 keys[KEY_HISTORY_MAX];
+  int size;
+} key_history_t;
+
+// Record key as the position before a move just played in the game, whose
+// rule50 is that after it: an irreversible move drops the whole window
+static inline void key_history_push(key_history_t *h, u64 key, u8 rule50) {
+  if (!rule50) {
+    h->size = 0;
+    return;
+  }
+  if (h->size == KEY_HISTORY_MAX) {
+    memmove(h->keys, h->keys + 1, (KEY_HISTORY_MAX - 1) * sizeof(u64));
+    h->size--;
+  }
+  h->keys[h->size++] = key;
+}
+
+// One per search thread. Everything here is private to its thread except
+// shared_nodes; the transposition table is the only state threads share.
+typedef struct search_t {
+  int id; // thread index, 0 is the main thread
+  board_t bd;
+  search_limits_t limits;
+  double start;
+  u64 nodes;
+  _Atomic u64 shared_nodes; // nodes as last published for other threads
+  bool stopped;
+  bool pondering; // main thread: still on the opponent's time
+  bool solo;      // not part of the Lazy SMP pool: watches only its own
+                  // limits and leaves threads.stop alone
+  bool nnue;      // evaluate with the network, else the PSTs
+  tt_t *tt;       // hash table, &tt unless a match engine
+  // Result of the last completed iteration
+  int depth;
+  int score;
+  pv_line_t pv;
+  // Keys of the positions before the root (root_keys of them), then of
+  // the one at each ply of the current line
+  u64 keys[KEY_HISTORY_MAX + MAX_PLY + 1];
+  int root_keys;
+  search_stack_t ss[MAX_PLY + 1];
+  // Move ordering
+  move_t killers[MAX_PLY][2];                        // quiet cutoff moves
+  move_t counter_moves[2][KING + 1][WIDTH * HEIGHT]; // by previous piece, to
+  int history[2][WIDTH * HEIGHT][WIDTH * HEIGHT]; // by side, from, to
+  nnue_acc_t acc[MAX_PLY + 1]; // NNUE accumulator by ply, if nnue
+} search_t;
+
+#define MAX_THREADS 256
+#define MAX_NUMA_NODES 64
+
+// Lazy SMP: every thread searches the same root with its own search_t and
+// they cooperate only through the transposition table. The threads are
+// started once by threads_init and sleep on the wake condition between
+// jobs: searches, parallel perft, batch analysis and matches.
+static struct {
+  int n;
+  search_t *workers[MAX_THREADS]; // first touched by their own thread
+  bool pin;                       // one CPU per thread
+  bool numa;                      // keep threads spread over NUMA nodes
+  cpu_set_t allowed;              // CPUs the process may run on
+  int n_nodes;
+  cpu_set_t node_cpus[MAX_NUMA_NODES];
+  // The pool, under lock
+  pthread_t handles[MAX_THREADS];
+  int started; // threads running, 0 before the first threads_init
+  pthread_mutex_t lock;
+  pthread_cond_t wake; // a job was posted, or quit
+  pthread_cond_t done; // the last thread finished the job
+  void (*job)(int id);
+  u64 jobs; // posted so far, so each thread runs each job once
+  int busy; // threads still running the job
+  bool quit;
+  // The search in progress
+  board_t root;
+  key_history_t history; // game positions before the root
+  search_limits_t limits;
+  double start;
+  void (*on_done)(const search_t *s); // main thread's result, if not NULL
+  atomic_bool stop;
+  atomic_bool ponder; // cleared on ponderhit
+} threads = {.n = 1,
+             .lock = PTHREAD_MUTEX_INITIALIZER,
+             .wake = PTHREAD_COND_INITIALIZER,
+             .done = PTHREAD_COND_INITIALIZER};
+
+// Nodes searched so far by all threads, as they last published them
+static u64 threads_nodes(void) {
+  u64 total = 0;
+  for (int i = 0; i < threads.n; ++i)
+    total += atomic_load_explicit(&threads.workers[i]->shared_nodes,
+                                  memory_order_relaxed);
+  return total;
+}
+
+// Nodes searched so far as seen from s: its own exact count, plus the
+// published counts of the other threads unless it searches alone
+static u64 search_nodes(const search_t *s) {
+  u64 total = s->nodes;
+  if (!s->solo)
+    for (int i = 0; i < threads.n; ++i)
+      if (threads.workers[i] != s)
+        total += atomic_load_explicit(&threads.workers[i]->shared_nodes,
+                                      memory_order_relaxed);
+  return total;
+}
+
+// Mate scores are stored relative to the node, not the root
+static inline int score_to_tt(int score, int ply) {
+  if (score >= VALUE_MATE_IN_MAX)
+    return score + ply;
+  if (score <= -VALUE_MATE_IN_MAX)
+    return score - ply;
+  return score;
+}
+
+static inline int score_from_tt(int score, int ply) {
+  if (score >= VALUE_MATE_IN_MAX)
+    return score - ply;
+  if (score <= -VALUE_MATE_IN_MAX)
+    return score + ply;
+  return score;
+}
+
+static inline bool has_non_pawn_material(const board_t *bd, bool color) {
+  const u8 *n = bd->piece_count[color];
+  return n[KNIGHT] | n[BISHOP] | n[ROOK] | n[QUEEN];
+}
+
+static inline int material(const board_t *bd, bool color) {
+  int sum = 0;
+  for (int id = PAWN; id < KING; ++id)
+    sum += bd->piece_count[color][id] * piece_value[id];
+  return sum;
+}
+
+// Known wins score VALUE_KNOWN_WIN plus the winner's material, so the score
+// only goes up as the win is converted: promoting the pawn of a won KPK
+// gains the queen's value over the pawn, more than any progress term below.
+
+// Exact result of an endgame the bitbase knows, for the side to move:
+// false if bd is not one. Wins are scored by how far the pawn has got and
+// how close the kings are to it, so that winning lines make progress.
+static bool endgame_score(const board_t *bd, int *score) {
+  if (bd->occupied != (bd->pieces[KING] | bd->pieces[PAWN]) ||
+      popcount(bd->occupied) > 3)
+    return false;
+  if (!bd->pieces[PAWN]) { // bare kings
+    *score = 0;
+    return true;
+  }
+  if (!kpk_win(bd)) {
+    *score = 0;
+    return true;
+  }
+  bool strong = (bd->pieces[PAWN] & bd->colors[WHITE]) ? WHITE : BLACK;
+  u8 psq = bitscan(bd->pieces[PAWN]);
+  int rank = strong == WHITE ? psq / 8 : 7 - psq / 8;
+  int win = VALUE_KNOWN_WIN + material(bd, strong) + 10 * rank -
+            4 * square_distance(bd->king_sq[strong], psq) +
+            4 * square_distance(bd->king_sq[!strong], psq);
+  *score = bd->next_to_move == strong ? win : -win;
+  return true;
+}
+
+// Rings out from the centre: 0 on d4-e5, 3 on the edge
+static inline int center_distance(u8 sq) {
+  int x = sq % 8 < 4 ? 3 - sq % 8 : sq % 8 - 4;
+  int y = sq / 8 < 4 ? 3 - sq / 8 : sq / 8 - 4;
+  return x > y ? x : y;
+}
+
+// Static score of a queen or rook against a bare king, which is what a won
+// KPK becomes: a known win that grows as the bare king is driven to the
+// edge and the other king closes in. Unlike endgame_score this does not end
+// the search, since the bare king may still take what is left hanging.
+static bool lone_king_score(const board_t *bd, int *score) {
+  bool strong;
+  if (popcount(bd->colors[BLACK]) == 1)
+    strong = WHITE;
+  else if (popcount(bd->colors[WHITE]) == 1)
+    strong = BLACK;
+  else
+    return false;
+  if (!bd->piece_count[strong][QUEEN] && !bd->piece_count[strong][ROOK])
+    return false;
+  int kings = square_distance(bd->king_sq[WHITE], bd->king_sq[BLACK]);
+  int win = VALUE_KNOWN_WIN + material(bd, strong) +
+            20 * center_distance(bd->king_sq[!strong]) + 10 * (7 - kings);
+  *score = bd->next_to_move == strong ? win : -win;
+  return true;
+}
+
+static inline bool is_capture(const board_t *bd, move_t mv) {
+  return (bd->occupied & BB(move_to(mv))) ||
+         move_kind(mv) == MOVE_EN_PASSANT;
+}
+
+// Static evaluation of the node at ply with the evaluator in use
+static inline int eval_node(const search_t *s, int ply) {
+  int score;
+  if (lone_king_score(&s->bd, &score))
+    return score;
+  STAT_TIMER_START(TIMER_EVAL);
+  score = s->nnue ? nnue_evaluate(&s->bd, &s->acc[ply]) : evaluate(&s->bd);
+  STAT_TIMER_STOP(TIMER_EVAL);
+  if (score >= VALUE_MATE_IN_MAX)
+    return VALUE_MATE_IN_MAX - 1;
+  if (score <= -VALUE_MATE_IN_MAX)
+    return -VALUE_MATE_IN_MAX + 1;
+  return score;
+}
+
+// make_move that also carries the NNUE accumulator to ply + 1. Taking the
+// move back needs nothing extra: the accumulator at ply is untouched.
+static inline void search_make_move(search_t *s, int ply, move_t mv,
+                                    undo_t *undo) {
+  STAT_TIMER_START(TIMER_MAKE_MOVE);
+  make_move(&s->bd, mv, undo);
+  if (s->nnue)
+    nnue_make_move(&s->bd, &s->acc[ply + 1], &s->acc[ply], mv, undo);
+  STAT_TIMER_STOP(TIMER_MAKE_MOVE);
+}
+
+// Id of the piece mv takes, 0 for none
+static inline u8 captured_id(const board_t *bd, move_t mv) {
+  if (move_kind(mv) == MOVE_EN_PASSANT)
+    return PAWN;
+  return piece_at(bd, move_to(mv)).id;
+}
+
+/* =========================
+   Move ordering
+   ========================= */
+
+// Score bands, highest first
+#define ORDER_TT (1 << 30)
+#define ORDER_CAPTURE (1 << 28) // plus MVV-LVA
+#define ORDER_KILLER (1 << 27)  // plus 1 for the first slot
+#define ORDER_COUNTER (1 << 26)
+
+// Picker stages, in the order they are run
+#define STAGE_TT 0
+#define STAGE_CAPTURES_INIT 1
+#define STAGE_CAPTURES 2
+#define STAGE_QUIETS_INIT 3
+#define STAGE_QUIETS 4
+#define STAGE_BAD_CAPTURES 5
+#define STAGE_DONE 6
+
+// Most valuable victim first, least valuable attacker breaks ties
+static inline int mvv_lva(const board_t *bd, move_t mv) {
+  return 8 * (piece_value[captured_id(bd, mv)] +
+              piece_value[move_promotion(mv)]) -
+         piece_at(bd, move_from(mv)).id;
+}
+
+static void picker_init(move_picker_t *mp, const search_t *s, int ply,
+                        move_t tt_move, bool captures_only) {
+  mp->stage = STAGE_TT;
+  mp->captures_only = captures_only;
+  mp->bad_size = mp->bad_next = 0;
+  mp->tt_move = tt_move;
+  mp->s = s;
+  mp->ply = ply;
+  mp->counter = 0;
+  if (ply > 0 && s->ss[ply - 1].played) {
+    u8 prev_to = move_to(s->ss[ply - 1].played);
+    mp->counter = s->counter_moves[!s->bd.next_to_move]
+                                  [piece_at(&s->bd, prev_to).id][prev_to];
+  }
+}
+
+static void score_captures(move_picker_t *mp) {
+  for (usize i = 0; i < mp->list.size; ++i)
+    mp->scores[i] = ORDER_CAPTURE + mvv_lva(&mp->s->bd, mp->list.handle[i]);
+}
+
+static void score_quiets(move_picker_t *mp) {
+  const search_t *s = mp->s;
+  bool us = s->bd.next_to_move;
+  for (usize i = 0; i < mp->list.size; ++i) {
+    move_t mv = mp->list.handle[i];
+    int score;
+    if (mv == s->killers[mp->ply][0])
+      score = ORDER_KILLER + 1;
+    else if (mv == s->killers[mp->ply][1])
+      score = ORDER_KILLER;
+    else if (mv == mp->counter)
+      score = ORDER_COUNTER;
+    else
+      score = s->history[us][move_from(mv)][move_to(mv)];
+    mp->scores[i] = score;
+  }
+}
+
+// Selection sort, one step per call, so a cutoff skips the rest
+static bool select_best(move_picker_t *mp, move_t *out) {
+  while (mp->next < mp->list.size) {
+    usize best = mp->next;
+    for (usize i = mp->next + 1; i < mp->list.size; ++i)
+      if (mp->scores[i] > mp->scores[best])
+        best = i;
+
+    *out = mp->list.handle[best];
+    mp->list.handle[best] = mp->list.handle[mp->next];
+    mp->scores[best] = mp->scores[mp->next];
+    mp->next++;
+    if (*out != mp->tt_move) // already tried first
+      return true;
+  }
+  return false;
+}
+
+// Next move to search at this node, false once all are exhausted. The
+// board must be the one the picker was set up for.
+static bool picker_next(move_picker_t *mp, board_t *bd, move_t *out) {
+  switch (mp->stage) {
+  case STAGE_TT:
+    mp->stage = STAGE_CAPTURES_INIT;
+    if (mp->tt_move) {
+      *out = mp->tt_move;
+      STAT_INC(tt_move_tests);
+      if (move_is_legal(bd, *out) &&
+          (!mp->captures_only || is_capture(bd, *out) ||
+           move_promotion(*out)))
+        return true;
+      STAT_INC(tt_move_rejects);
+      mp->tt_move = 0;
+    }
+    // fall through
+  case STAGE_CAPTURES_INIT:
+    list_legal_captures(bd, &mp->list);
+    mp->next = 0;
+    score_captures(mp);
+    mp->stage = STAGE_CAPTURES;
+    // fall through
+  case STAGE_CAPTURES:
+    while (select_best(mp, out)) {
+      if (see(bd, *out) >= 0)
+        return true;
+      if (!mp->captures_only)
+        mp->bad[mp->bad_size++] = *out;
+    }
+    if (mp->captures_only) {
+      mp->stage = STAGE_DONE;
+      return false;
+    }
+    mp->stage = STAGE_QUIETS_INIT;
+    // fall through
+  case STAGE_QUIETS_INIT:
+    list_legal_quiets(bd, &mp->list);
+    mp->next = 0;
+    score_quiets(mp);
+    mp->stage = STAGE_QUIETS;
+    // fall through
+  case STAGE_QUIETS:
+    if (select_best(mp, out))
+      return true;
+    mp->stage = STAGE_BAD_CAPTURES;
+    // fall through
+  case STAGE_BAD_CAPTURES:
+    if (mp->bad_next < mp->bad_size) {
+      *out = mp->bad[mp->bad_next++];
+      return true;
+    }
+    mp->stage = STAGE_DONE;
+    // fall through
+  default:
+    return false;
+  }
+}
+
+// History gravity keeps entries within +-HISTORY_MAX
+static inline void history_update(int *entry, int bonus) {
+  *entry += bonus - *entry * (bonus < 0 ? -bonus : bonus) / HISTORY_MAX;
+}
+
+// A quiet move caused a beta cutoff: remember it, and penalise the quiet
+// moves that were tried before it
+static void update_quiet_stats(search_t *s, int ply, int depth, move_t best,
+                               const move_t *tried, int n_tried) {
+  bool us = s->bd.next_to_move;
+  int bonus = depth * depth < 1200 ? depth * depth : 1200;
+
+  if (s->killers[ply][0] != best) {
+    s->killers[ply][1] = s->killers[ply][0];
+    s->killers[ply][0] = best;
+  }
+  if (ply > 0 && s->ss[ply - 1].played) {
+    u8 prev_to = move_to(s->ss[ply - 1].played);
+    s->counter_moves[!us][piece_at(&s->bd, prev_to).id][prev_to] = best;
+  }
+
+  history_update(&s->history[us][move_from(best)][move_to(best)], bonus);
+  for (int i = 0; i < n_tried; ++i)
+    history_update(&s->history[us][move_from(tried[i])][move_to(tried[i])],
+                   -bonus);
+}
+
+// Whether the main thread is still pondering. The clock only starts
+// running at ponderhit, so the search start is moved there.
+static bool pondering(search_t *s) {
+  if (s->pondering && !atomic_load_explicit(&threads.ponder,
+                                            memory_order_relaxed)) {
+    s->pondering = false;
+    s->start = now_seconds();
+  }
+  return s->pondering;
+}
+
+static void check_limits(search_t *s) {
+  atomic_store_explicit(&s->shared_nodes, s->nodes, memory_order_relaxed);
+  if (atomic_load_explicit(&threads.stop, memory_order_relaxed)) {
+    s->stopped = true;
+    return;
+  }
+  // Only the main thread watches the limits, and never stops before one
+  // iteration is complete, we need a move
+  if (s->id || !s->depth || pondering(s))
+    return;
+  u64 nodes = search_nodes(s);
+  if ((s->limits.nodes && nodes >= s->limits.nodes) ||
+      (s->limits.time && now_seconds() - s->start >= s->limits.time)) {
+    s->stopped = true;
+    if (!s->solo)
+      atomic_store(&threads.stop, true);
+  }
+}
+
+// Margin over the captured piece a capture needs to possibly raise alpha
+#define DELTA_MARGIN 200
+
+// Capture-only search below the horizon, so leaves are only scored in
+// quiet positions. In check every evasion is searched instead.
+static int qsearch(search_t *s, int ply, int alpha, int beta) {
+  STAT_INC(qnodes);
+  if ((++s->nodes & 255) == 0) // about every 0.2ms
+    check_limits(s);
+  if (s->stopped)
+    return 0;
+
+  board_t *bd = &s->bd;
+  if (ply >= MAX_PLY - 1)
+    return eval_node(s, ply);
+  int known;
+  if (endgame_score(bd, &known))
+    return known;
+
+  bool pv_node = beta - alpha > 1;
+  tt_data_t tte;
+  move_t tt_move = MOVE_NONE;
+  bool tt_hit = tt_probe(s->tt, bd->st.key, &tte);
+  if (tt_hit) {
+    tt_move = tte.move;
+    int tt_score = score_from_tt(tte.score, ply);
+    if (!pv_node &&
+        (tte.bound == BOUND_EXACT ||
+         (tte.bound == BOUND_LOWER && tt_score >= beta) ||
+         (tte.bound == BOUND_UPPER && tt_score <= alpha)))
+      return tt_score;
+  }
+
+  bool in_check = is_check(bd);
+  // Every entry carries the static eval of its position
+  int static_eval = tt_hit ? tte.eval : eval_node(s, ply);
+  int best = -VALUE_INF;
+  if (!in_check) {
+    // Stand pat: the side to move is not forced to capture
+    best = static_eval;
+    if (best >= beta)
+      return best;
+    if (best > alpha)
+      alpha = best;
+  }
+
+  search_stack_t *ss = &s->ss[ply];
+  picker_init(&ss->mp, s, ply, tt_move, !in_check);
+  move_t best_move = MOVE_NONE;
+  u8 bound = BOUND_UPPER;
+  int n_moves = 0;
+
+  move_t mv;
+  while (picker_next(&ss->mp, bd, &mv)) {
+    n_moves++;
+    // Delta pruning: even winning the piece outright cannot reach alpha
+    if (!in_check && !move_promotion(mv) &&
+        static_eval + see_value[captured_id(bd, mv)] + DELTA_MARGIN <= alpha)
+      continue;
+
+    ss->played = mv;
+    search_make_move(s, ply, mv, &ss->undo);
+    int score = -qsearch(s, ply + 1, -beta, -alpha);
+    unmake_move(bd, mv, &ss->undo);
+    if (s->stopped)
+      return 0;
+
+    if (score > best) {
+      best = score;
+      if (score > alpha) {
+        alpha = score;
+        best_move = mv;
+        bound = BOUND_EXACT;
+        if (score >= beta) {
+          bound = BOUND_LOWER;
+          break;
+        }
+      }
+    }
+  }
+
+  if (in_check && !n_moves)
+    return -VALUE_MATE + ply;
+
+  tt_store(s->tt, bd->st.key, best_move, (i16)score_to_tt(best, ply),
+           (i16)static_eval, 0, bound);
+  return best;
+}
+
+// Whether the position at ply repeats one since the last irreversible move,
+// in the game or in the search, not looking past a null move. A single
+// repetition is enough: a side that can repeat once can do so again.
+static bool is_repetition(const search_t *s, int ply) {
+  int end = s->bd.st.rule50 < s->ss[ply].from_null ? s->bd.st.rule50
+                                                    : s->ss[ply].from_null;
+  const u64 *key = &s->keys[s->root_keys + ply];
+  for (int i = 4; i <= end && i <= s->root_keys + ply; i += 2)
+    if (key[-i] == *key)
+      return true;
+  return false;
+}
+
+// Searches the position at ply, leaving its best line in s->ss[ply].pv
+static int negamax(search_t *s, int depth, int ply, int alpha, int beta,
+                   bool null_ok) {
+  search_stack_t *ss = &s->ss[ply];
+  pv_line_t *pv = &ss->pv, *child = &s->ss[ply + 1].pv;
+  pv->size = 0;
+  board_t *bd = &s->bd;
+  bool in_check = is_check(bd);
+  if (in_check)
+    depth++; // check extension
+  if (depth <= 0)
+    return qsearch(s, ply, alpha, beta);
+
+  STAT_INC(nodes);
+  if ((++s->nodes & 255) == 0) // about every 0.2ms
+    check_limits(s);
+  if (s->stopped)
+    return 0;
+  if (ply >= MAX_PLY - 1)
+    return eval_node(s, ply);
+  if (ply) {
+    s->keys[s->root_keys + ply] = bd->st.key;
+    ss->from_null = s->ss[ply - 1].played ? s->ss[ply - 1].from_null + 1 : 0;
+    if (is_repetition(s, ply))
+      return 0;
+    // Fifty moves without a capture or pawn move, unless they end in mate
+    if (bd->st.rule50 >= 100) {
+      move_list_t evasions;
+      if (!in_check || (list_legals(bd, &evasions), evasions.size))
+        return 0;
+    }
+  }
+  // Known endgames end the search here, except at the root that needs a move
+  int known;
+  if (ply && endgame_score(bd, &known))
+    return known;
+
+  bool pv_node = beta - alpha > 1;
+
+  tt_data_t tte;
+  move_t tt_move = MOVE_NONE;
+  bool tt_hit = tt_probe(s->tt, bd->st.key, &tte);
+  if (tt_hit) {
+    tt_move = tte.move;
+    int tt_score = score_from_tt(tte.score, ply);
+    if (!pv_node && tte.depth >= depth &&
+        (tte.bound == BOUND_EXACT ||
+         (tte.bound == BOUND_LOWER && tt_score >= beta) ||
+         (tte.bound == BOUND_UPPER && tt_score <= alpha)))
+      return tt_score;
+  }
+
+  int static_eval = tt_hit ? tte.eval : eval_node(s, ply);
+
+  // Null move: if passing still fails high, a real move surely would
+  if (null_ok && !pv_node && !in_check && depth >= 3 && static_eval >= beta &&
+      has_non_pawn_material(bd, bd->next_to_move)) {
+    int r = 2 + depth / 4;
+    ss->played = 0;
+    make_null_move(bd, &ss->undo);
+    if (s->nnue)
+      s->acc[ply + 1] = s->acc[ply];
+    int score = -negamax(s, depth - 1 - r, ply + 1, -beta, -beta + 1, false);
+    unmake_null_move(bd, &ss->undo);
+    if (s->stopped)
+      return 0;
+    if (score >= beta)
+      return score >= VALUE_MATE_IN_MAX ? beta : score;
+  }
+
+  picker_init(&ss->mp, s, ply, tt_move, false);
+
+  int best = -VALUE_INF;
+  move_t best_move = MOVE_NONE;
+  u8 bound = BOUND_UPPER;
+  ss->quiets_size = 0;
+
+  move_t mv;
+  int n_moves = 0;
+  while (picker_next(&ss->mp, bd, &mv)) {
+    int i = n_moves++; // index in search order
+    bool quiet = !is_capture(bd, mv) && !move_promotion(mv);
+    ss->played = mv;
+    search_make_move(s, ply, mv, &ss->undo);
+
+    int score;
+    if (i == 0) {
+      score = -negamax(s, depth - 1, ply + 1, -beta, -alpha, true);
+    } else {
+      // Late move reductions for quiet moves, then a null window search
+      // that is widened only when it beats alpha
+      int r = 0;
+      if (depth >= 3 && i >= 3 && quiet && !in_check) {
+        r = 1 + (i >= 6) + (depth >= 8) - pv_node;
+        if (r > depth - 2)
+          r = depth - 2;
+      }
+      score = -negamax(s, depth - 1 - r, ply + 1, -alpha - 1, -alpha, true);
+      if (score > alpha && r > 0)
+        score = -negamax(s, depth - 1, ply + 1, -alpha - 1, -alpha, true);
+      if (score > alpha && score < beta)
+        score = -negamax(s, depth - 1, ply + 1, -beta, -alpha, true);
+    }
+    unmake_move(bd, mv, &ss->undo);
+    if (s->stopped)
+      return 0;
+
+    if (score > best) {
+      best = score;
+      if (score > alpha) {
+        alpha = score;
+        best_move = mv;
+        bound = BOUND_EXACT;
+        pv->moves[0] = mv;
+        memcpy(pv->moves + 1, child->moves, child->size * sizeof(move_t));
+        pv->size = child->size + 1;
+        if (score >= beta) {
+          bound = BOUND_LOWER;
+          STAT_INC(cutoffs);
+          STAT_ADD(first_move_cutoffs, i == 0);
+          if (quiet)
+            update_quiet_stats(s, ply, depth, best_move, ss->quiets,
+                               ss->quiets_size);
+          break;
+        }
+      }
+    }
+    if (quiet && ss->quiets_size < 64)
+      ss->quiets[ss->quiets_size++] = mv;
+  }
+
+  if (!n_moves)
+    return in_check ? -VALUE_MATE + ply : 0;
+
+  tt_store(s->tt, bd->st.key, best_move, (i16)score_to_tt(best, ply),
+           (i16)static_eval, (u8)depth, bound);
+  return best;
+}
+
+// Score as UCI puts it: "cp <centipawns>" or "mate <moves>", negative when
+// getting mated
+usize score_to_uci(int score, char buf[24]) {
+  int len;
+  if (score >= VALUE_MATE_IN_MAX)
+    len = snprintf(buf, 24, "mate %d", (VALUE_MATE - score + 1) / 2);
+  else if (score <= -VALUE_MATE_IN_MAX)
+    // "mate 0" when the side to move is already mated
+    len = snprintf(buf, 24, "mate %d", -((VALUE_MATE + score) / 2));
+  else
+    len = snprintf(buf, 24, "cp %d", score);
+  return (usize)len;
+}
+
+// Longest info line: the fixed fields, then up to MAX_PLY moves of pv
+#define INFO_LINE_MAX (160 + 6 * MAX_PLY)
+
+// One write, so the line stays whole even if the UCI thread prints
+static void print_search_info(const search_t *s) {
+  double secs = now_seconds() - s->start;
+  u64 nodes = search_nodes(s);
+  char line[INFO_LINE_MAX];
+  usize len = (usize)sprintf(line, "info depth %d score ", s->depth);
+  len += score_to_uci(s->score, line + len);
+  len += (usize)sprintf(line + len,
+                        " nodes %llu nps %.0f time %.0f hashfull %d pv",
+                        (unsigned long long)nodes,
+                        secs > 0 ? nodes / secs : 0.0, secs * 1000,
+                        tt_hashfull(s->tt));
+  for (int i = 0; i < s->pv.size; ++i) {
+    line[len++] = ' ';
+    len += move_to_uci(s->pv.moves[i], line + len);
+  }
+  line[len++] = '\n';
+  fwrite(line, 1, len, stdout);
+  fflush(stdout);
+}
+
+// Helper threads skip some depths so that they spread over several
+// iterations instead of all searching the same one
+static const int skip_size[20] = {1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                  3, 3, 4, 4, 4, 4, 4, 4, 4, 4};
+static const int skip_phase[20] = {0, 1, 0, 1, 2, 3, 0, 1, 2, 3,
+                                   4, 5, 0, 1, 2, 3, 4, 5, 6, 7};
+
+// Iterative deepening from s->bd within s->limits, run by every thread.
+// The best move is s->pv.moves[0] afterwards (none if the side to move has
+// no legal move).
+static void iterate(search_t *s) {
+  s->nodes = 0;
+  atomic_store_explicit(&s->shared_nodes, 0, memory_order_relaxed);
+  s->stopped = false;
+  s->depth = 0;
+  s->score = 0;
+  s->pv.size = 0;
+  s->keys[s->root_keys] = s->bd.st.key;
+  s->ss[0].from_null = KEY_HISTORY_MAX + MAX_PLY; // no null move before
+  if (s->nnue)
+    nnue_refresh(&s->bd, &s->acc[0]);
+
+  // Killers are position specific, history carries over at half weight
+  memset(s->killers, 0, sizeof(s->killers));
+  for (int c = 0; c < 2; ++c)
+    for (int from = 0; from < WIDTH * HEIGHT; ++from)
+      for (int to = 0; to < WIDTH * HEIGHT; ++to)
+        s->history[c][from][to] /= 2;
+
+  int max_depth = s->limits.depth ? s->limits.depth : MAX_PLY - 1;
+  for (int depth = 1; depth <= max_depth; ++depth) {
+    if (s->id) {
+      int i = (s->id - 1) % 20;
+      if ((depth + skip_phase[i]) / skip_size[i] % 2)
+        continue;
+    }
+
+    // Aspiration window around the last score, widened on failure
+    int delta = 25;
+    int alpha = -VALUE_INF, beta = VALUE_INF;
+    if (depth >= 5) {
+      alpha = s->score - delta > -VALUE_INF ? s->score - delta : -VALUE_INF;
+      beta = s->score + delta < VALUE_INF ? s->score + delta : VALUE_INF;
+    }
+
+    int score;
+    for (;;) {
+      score = negamax(s, depth, 0, alpha, beta, false);
+      if (s->stopped)
+        break;
+      if (score <= alpha) {
+        beta = (alpha + beta) / 2;
+        alpha = score - delta > -VALUE_INF ? score - delta : -VALUE_INF;
+      } else if (score >= beta) {
+        beta = score + delta < VALUE_INF ? score + delta : VALUE_INF;
+      } else {
+        break;
+      }
+      delta += delta / 2;
+    }
+    if (s->stopped)
+      break;
+
+    s->depth = depth;
+    s->score = score;
+    s->pv = s->ss[0].pv;
+    if (!s->id && !s->limits.quiet)
+      print_search_info(s);
+    if (!s->pv.size) // mate or stalemate at the root
+      break;
+    // Another iteration would most likely not finish in time
+    if (!s->id && s->limits.soft_time && !pondering(s) &&
+        now_seconds() - s->start >= s->limits.soft_time)
+      break;
+  }
+  atomic_store_explicit(&s->shared_nodes, s->nodes, memory_order_relaxed);
+
+  // When infinite or pondering, the GUI expects the best move only after
+  // stop or ponderhit
+  while (!s->id && (s->limits.infinite || pondering(s)) &&
+         !atomic_load(&threads.stop))
+    nanosleep(&(struct timespec){.tv_nsec = 200000}, NULL);
+}
+
+/* =========================
+   Lazy SMP threads
+   ========================= */
+
+// n-th CPU (0 based) in set, wrapping around
+static int nth_cpu(const cpu_set_t *set, int n) {
+  int count = CPU_COUNT(set);
+  n %= count;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    if (CPU_ISSET(cpu, set) && n-- == 0)
+      return cpu;
+  return 0;
+}
+
+// Parse a sysfs CPU list such as "0-15,32-47"
+static bool parse_cpulist(const char *str, cpu_set_t *set) {
+  CPU_ZERO(set);
+  while (*str && *str != '\n') {
+    char *end;
+    long lo = strtol(str, &end, 10), hi = lo;
+    if (end == str)
+      return false;
+    if (*end == '-')
+      hi = strtol(end + 1, &end, 10);
+    for (long cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; ++cpu)
+      CPU_SET(cpu, set);
+    str = *end == ',' ? end + 1 : end;
+  }
+  return CPU_COUNT(set) > 0;
+}
+
+// Read the CPUs of each NUMA node the process may use, 0 if not NUMA
+static int read_numa_nodes(void) {
+  int n = 0;
+  for (int node = 0; node < MAX_NUMA_NODES; ++node) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    FILE *f = fopen(path, "r");
+    if (!f)
+      continue;
+    bool ok = fgets(buf, sizeof(buf), f) &&
+              parse_cpulist(buf, &threads.node_cpus[n]);
+    fclose(f);
+    if (!ok)
+      continue;
+    CPU_AND(&threads.node_cpus[n], &threads.node_cpus[n], &threads.allowed);
+    n += CPU_COUNT(&threads.node_cpus[n]) > 0;
+  }
+  return n;
+}
+
+// Restrict the calling thread to where thread id belongs: its node with
+// numa, one CPU of it with pin, a CPU of the process with pin alone
+static void bind_thread(int id) {
+  cpu_set_t set;
+  if (threads.numa && threads.n_nodes > 1) {
+    const cpu_set_t *node = &threads.node_cpus[id % threads.n_nodes];
+    if (threads.pin) {
+      CPU_ZERO(&set);
+      CPU_SET(nth_cpu(node, id / threads.n_nodes), &set);
+    } else {
+      set = *node;
+    }
+  } else if (threads.pin) {
+    CPU_ZERO(&set);
+    CPU_SET(nth_cpu(&threads.allowed, id), &set);
+  } else {
+    return;
+  }
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// Body of each pool thread: run every job posted until told to quit
+static void *pool_main(void *arg) {
+  int id = (int)(intptr_t)arg;
+  bind_thread(id);
+  u64 seen = 0;
+  pthread_mutex_lock(&threads.lock);
+  for (;;) {
+    while (threads.jobs == seen && !threads.quit)
+      pthread_cond_wait(&threads.wake, &threads.lock);
+    if (threads.quit)
+      break;
+    seen = threads.jobs;
+    void (*job)(int) = threads.job;
+    pthread_mutex_unlock(&threads.lock);
+    job(id);
+    stats_flush();
+    pthread_mutex_lock(&threads.lock);
+    if (--threads.busy == 0)
+      pthread_cond_signal(&threads.done);
+  }
+  pthread_mutex_unlock(&threads.lock);
+  return NULL;
+}
+
+// Run job(id) on every pool thread, returning at once
+static void threads_start(void (*job)(int id)) {
+  pthread_mutex_lock(&threads.lock);
+  threads.job = job;
+  threads.busy = threads.n;
+  threads.jobs++;
+  pthread_cond_broadcast(&threads.wake);
+  pthread_mutex_unlock(&threads.lock);
+}
+
+// Wait until every thread is done with the job threads_start posted
+static void threads_wait(void) {
+  pthread_mutex_lock(&threads.lock);
+  while (threads.busy)
+    pthread_cond_wait(&threads.done, &threads.lock);
+  pthread_mutex_unlock(&threads.lock);
+}
+
+static void threads_run(void (*job)(int id)) {
+  threads_start(job);
+  threads_wait();
+}
+
+// Use n search threads from the next search on, with fresh tables
+void threads_init(int n, bool pin, bool numa) {
+  ASSERT(n >= 1 && n <= MAX_THREADS, "Bad thread count");
+  pthread_mutex_lock(&threads.lock);
+  threads.quit = true;
+  pthread_cond_broadcast(&threads.wake);
+  pthread_mutex_unlock(&threads.lock);
+  for (int i = 0; i < threads.started; ++i)
+    pthread_join(threads.handles[i], NULL);
+  for (int i = 0; i < threads.n; ++i)
+    if (threads.workers[i])
+      munmap(threads.workers[i], sizeof(search_t));
+
+  threads.n = n;
+  threads.pin = pin;
+  threads.numa = numa;
+  if (sched_getaffinity(0, sizeof(threads.allowed), &threads.allowed) < 0) {
+    CPU_ZERO(&threads.allowed);
+    CPU_SET(0, &threads.allowed);
+  }
+  threads.n_nodes = numa ? read_numa_nodes() : 0;
+
+  // mmap hands out zeroed pages that are only backed when first written,
+  // which the owning thread does after binding: that puts its tables on
+  // its own NUMA node
+  for (int i = 0; i < n; ++i) {
+    void *mem = mmap(NULL, sizeof(search_t), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT(mem != MAP_FAILED, "Out of memory for search threads");
+    threads.workers[i] = mem;
+  }
+
+  threads.quit = false;
+  threads.jobs = 0;
+  for (int i = 0; i < n; ++i)
+    if (pthread_create(&threads.handles[i], NULL, pool_main,
+                       (void *)(intptr_t)i))
+      ASSERT(false, "Cannot start search thread");
+  threads.started = n;
+}
+
+static void clear_job(int id) {
+  memset(threads.workers[id], 0, sizeof(search_t));
+}
+
+// Forget what the threads learnt in earlier searches, as a fresh
+// threads_init would
+void threads_clear(void) { threads_run(clear_job); }
+
+static void search_job(int id) {
+  search_t *s = threads.workers[id];
+  s->id = id;
+  s->solo = false;
+  s->nnue = use_nnue;
+  s->tt = &tt;
+  s->bd = threads.root;
+  memcpy(s->keys, threads.history.keys, threads.history.size * sizeof(u64));
+  s->root_keys = threads.history.size;
+  s->limits = threads.limits;
+  s->start = threads.start;
+  s->pondering = atomic_load(&threads.ponder);
+  iterate(s);
+  // The main thread's result stands, the helpers stop with it
+  if (!id) {
+    atomic_store(&threads.stop, true);
+    if (threads.on_done)
+      threads.on_done(s);
+  }
+}
+
+// Start searching bd on all threads within limits and return at once.
+// history, if not NULL, holds the game positions that led to bd. on_done,
+// if not NULL, is called on the main thread with its result when the
+// search ends. Setting threads.stop ends the search, setting
+// threads.ponder beforehand makes it a ponder search; either way
+// threads_search_wait must follow before the next one.
+void threads_search_start(const board_t *bd, const key_history_t *history,
+                          search_limits_t limits,
+                          void (*on_done)(const search_t *s)) {
+  tt_new_search(&tt);
+  threads.root = *bd;
+  threads.history.size = 0;
+  if (history)
+    threads.history = *history;
+  threads.limits = limits;
+  threads.start = now_seconds();
+  threads.on_done = on_done;
+  threads_start(search_job);
+}
+
+// Wait for the search to end and return the main thread, which holds the
+// result
+search_t *threads_search_wait(void) {
+  threads_wait();
+  atomic_store(&threads.stop, false);
+  atomic_store(&threads.ponder, false);
+  return threads.workers[0];
+}
+
+// threads_search_start and wait
+search_t *threads_search(const board_t *bd, const key_history_t *history,
+                         search_limits_t limits) {
+  threads_search_start(bd, history, limits, NULL);
+  return threads_search_wait();
+}
+
+/* =========================
+   Perft
+   ========================= */
+
+// Subtree counts by (key, depth), shared by all perft threads. Like the
+// transposition table, check is the key XOR the count so that an entry torn
+// by two racing writers reads as a miss.
+typedef struct perft_entry_t {
+  _Atomic u64 check;
+  _Atomic u64 count;
+} perft_entry_t;
+
+static struct {
+  perft_entry_t *entries;
+  usize count;
+  usize bytes;
+} perft_cache;
+
+// Give perft a cache of about mb megabytes, none if 0
+void perft_cache_init(usize mb) {
+  if (perft_cache.entries)
+    munmap(perft_cache.entries, perft_cache.bytes);
+  perft_cache.entries = NULL;
+  perft_cache.count = 0;
+  if (!mb)
+    return;
+  usize bytes = mb * 1024 * 1024;
+  void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT(mem != MAP_FAILED, "Out of memory");
+  perft_cache.entries = mem;
+  perft_cache.bytes = bytes;
+  perft_cache.count = bytes / sizeof(perft_entry_t);
+}
+
+static inline u64 perft_key(u64 key, int depth) {
+  return key ^ (u64)depth * 0x9e3779b97f4a7c15ull;
+}
+
+static inline perft_entry_t *perft_entry(u64 pkey) {
+  return &perft_cache
+              .entries[(u64)(((unsigned __int128)pkey * perft_cache.count) >>
+                             64)];
+}
+
+// Count leaf nodes of the legal move tree, depth plies deep. The last ply
+// is not played out, the legal move count is all that is needed.
+u64 perft(board_t *bd, int depth) {
+  if (depth == 0)
+    return 1;
+
+  move_list_t legal;
+  if (depth == 1) {
+    list_legals(bd, &legal);
+    return legal.size;
+  }
+
+  perft_entry_t *entry = NULL;
+  u64 pkey = perft_key(bd->st.key, depth);
+  if (perft_cache.entries) {
+    entry = perft_entry(pkey);
+    u64 check = atomic_load_explicit(&entry->check, memory_order_relaxed);
+    u64 count = atomic_load_explicit(&entry->count, memory_order_relaxed);
+    if ((check ^ count) == pkey)
+      return count;
+  }
+
+  list_legals(bd, &legal);
+  u64 nodes = 0;
+  for (usize i = 0; i < legal.size; ++i) {
+    undo_t undo;
+    make_move(bd, legal.handle[i], &undo);
+    nodes += perft(bd, depth - 1);
+    unmake_move(bd, legal.handle[i], &undo);
+  }
+
+  if (entry) {
+    atomic_store_explicit(&entry->check, pkey ^ nodes, memory_order_relaxed);
+    atomic_store_explicit(&entry->count, nodes, memory_order_relaxed);
+  }
+  return nodes;
+}
+
+// Root moves are handed out one at a time to whichever thread is free
+static struct {
+  board_t root;
+  int depth;
+  const move_list_t *moves;
+  u64 *counts;
+  atomic_size_t next;
+} perft_job;
+
+static void perft_worker(int id) {
+  (void)id;
+  board_t bd = perft_job.root;
+  for (;;) {
+    usize i = atomic_fetch_add(&perft_job.next, 1);
+    if (i >= perft_job.moves->size)
+      break;
+    undo_t undo;
+    make_move(&bd, perft_job.moves->handle[i], &undo);
+    perft_job.counts[i] = perft(&bd, perft_job.depth - 1);
+    unmake_move(&bd, perft_job.moves->handle[i], &undo);
+  }
+}
+
+// perft on threads.n threads, split by root move: fills legal with the
+// root moves and counts[i] with the nodes under legal->handle[i]
+u64 perft_split(board_t *bd, int depth, move_list_t *legal, u64 *counts) {
+  list_legals(bd, legal);
+  if (depth <= 1) {
+    for (usize i = 0; i < legal->size; ++i)
+      counts[i] = 1;
+    return legal->size;
+  }
+
+  perft_job.root = *bd;
+  perft_job.depth = depth;
+  perft_job.moves = legal;
+  perft_job.counts = counts;
+  atomic_store(&perft_job.next, 0);
+  threads_run(perft_worker);
+
+  u64 nodes = 0;
+  for (usize i = 0; i < legal->size; ++i)
+    nodes += counts[i];
+  return nodes;
+}
+
+// Parallel perft, total only
+u64 perft_parallel(board_t *bd, int depth) {
+  move_list_t legal;
+  u64 counts[MAX_MOVES];
+  return depth ? perft_split(bd, depth, &legal, counts) : 1;
+}
+
+// perft split by root move
+u64 divide(board_t *bd, int depth) {
+  move_list_t legal;
+  u64 counts[MAX_MOVES];
+  u64 nodes = perft_split(bd, depth, &legal, counts);
+  for (usize i = 0; i < legal.size; ++i) {
+    mprintf("%m", legal.handle[i]);
+    printf(": %llu\n", (unsigned long long)counts[i]);
+  }
+  return nodes;
+}
+
+#define STARTPOS "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1"
+
+// Reference positions with known node counts per depth (index 0 = depth 1)
+static const struct perft_ref_t {
+  const char *fen;
+  u64 nodes[6];
+} perft_refs[] = {
+    {STARTPOS, {20, 400, 8902, 197281, 4865609, 119060324}},
+    {"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+     {48, 2039, 97862, 4085603, 193690690}},
+    {"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+     {14, 191, 2812, 43238, 674624, 11030083}},
+    {"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+     {6, 264, 9467, 422333, 15833292}},
+    {"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+     {44, 1486, 62379, 2103487, 89941194}},
+};
+
+static void print_perft_stats(u64 nodes, double secs) {
+  printf("nodes %llu time %.3fs nps %.0f\n", (unsigned long long)nodes, secs,
+         secs > 0 ? (double)nodes / secs : 0.0);
+}
+
+// Run every reference position to depth (or its deepest known count).
+// Returns the number of mismatches.
+int perft_suite(int depth) {
+  int failures = 0;
+  u64 total = 0;
+  double total_secs = 0;
+
+  for (usize i = 0; i < sizeof(perft_refs) / sizeof(perft_refs[0]); ++i) {
+    const struct perft_ref_t *ref = &perft_refs[i];
+    int d = depth;
+    while (d > 1 && ref->nodes[d - 1] == 0)
+      d--;
+
+    board_t bd;
+    init_board_from_fen(&bd, ref->fen);
+    double start = now_seconds();
+    u64 nodes = perft_parallel(&bd, d);
+    double secs = now_seconds() - start;
+
+    bool ok = nodes == ref->nodes[d - 1];
+    failures += !ok;
+    total += nodes;
+    total_secs += secs;
+    printf("%s depth %d: %s ", ok ? "ok  " : "FAIL", d, ref->fen);
+    if (!ok)
+      printf("(expected %llu) ", (unsigned long long)ref->nodes[d - 1]);
+    print_perft_stats(nodes, secs);
+  }
+
+  printf("total: ");
+  print_perft_stats(total, total_secs);
+  return failures;
+}
 
-  return bd;
+/* =========================
+   Bench
+   ========================= */
+
+#define BENCH_DEPTH 9
+
+// Openings, middlegames, endgames, and some mates and stalemates at the root
+static const char *bench_fens[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 10",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 11",
+    "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+    "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+    "4rrk1/pp1n3p/3q2pQ/2p1pb2/2PP4/2P3N1/P2B2PP/4RRK1 b - - 7 19",
+    "rq3rk1/ppp2ppp/1bnpb3/3N2B1/3NP3/7P/PPPQ1PP1/2KR3R w - - 7 14",
+    "r1bq1r1k/1pp1n1pp/1p1p4/4p2Q/4Pp2/1BNP4/PPP2PPP/3R1RK1 w - - 2 14",
+    "r3r1k1/2p2ppp/p1p1bn2/8/1q2P3/2NPQN2/PPP3PP/R4RK1 b - - 2 15",
+    "r1bbk1nr/pp3p1p/2n5/1N4p1/2Np1B2/8/PPP2PPP/2KR1B1R w kq - 0 13",
+    "r1bq1rk1/ppp1nppp/4n3/3p3Q/3P4/1BP1B3/PP1N2PP/R4RK1 w - - 1 16",
+    "4r1k1/r1q2ppp/ppp2n2/4P3/5Rb1/1N1BQ3/PPP3PP/R5K1 w - - 1 17",
+    "2rqkb1r/ppp2p2/2npb1p1/1N1Nn2p/2P1PP2/8/PP2B1PP/R1BQK2R b KQ - 0 11",
+    "r1bq1r1k/b1p1npp1/p2p3p/1p6/3PP3/1B2NN2/PP3PPP/R2Q1RK1 w - - 1 16",
+    "3r1rk1/p5pp/bpp1pp2/8/q1PP1P2/b3P3/P2NQRPP/1R2B1K1 b - - 6 22",
+    "r1q2rk1/2p1bppp/2Pp4/p6b/Q1PNp3/4B3/PP1R1PPP/2K4R w - - 2 18",
+    "4k2r/1pb2ppp/1p2p3/1R1p4/3P4/2r1PN2/P4PPP/1R4K1 b - - 3 22",
+    "3q2k1/pb3p1p/4pbp1/2r5/PpN2N2/1P2P2P/5PP1/Q2R2K1 b - - 4 26",
+    "6k1/6p1/6Pp/ppp5/3pn2P/1P3K2/1PP2P2/8 b - - 3 54",
+    "6k1/3b3r/1p1p4/p1n2p2/1PPNpP1q/P3Q1p1/1R1RB1P1/5K2 b - - 0 1",
+    "r2r1n2/pp2bk2/2p1p2p/3q4/3PN1QP/2P3R1/P4PP1/5RK1 w - - 0 1",
+    "r1bqkb1r/pppp1ppp/2n2n2/4p2Q/2B1P3/8/PPPP1PPP/RNB1K1NR w KQkq - 4 4",
+    "rnbqkb1r/pp2pppp/3p1n2/8/3NP3/8/PPP2PPP/RNBQKB1R w KQkq - 1 5",
+    "r1bqk2r/pp2bppp/2n1pn2/2pp4/2PP4/2N1PN2/PP2BPPP/R1BQK2R w KQkq - 0 7",
+    "rnbq1rk1/ppp1ppbp/3p1np1/8/2PPP3/2N2N2/PP2BPPP/R1BQK2R b KQ - 1 6",
+    "r2qkbnr/ppp2ppp/2np4/4p3/2B1P1b1/5N2/PPPP1PPP/RNBQ1RK1 w kq - 2 5",
+    "rnbqkb1r/ppp1pppp/5n2/8/2pP4/8/PP2PPPP/RNBQKBNR w KQkq - 0 3",
+    "r1bqkbnr/pppp1ppp/2n5/4p3/4P3/5N2/PPPP1PPP/RNBQKB1R w KQkq - 2 3",
+    "r1b1kb1r/pppp1ppp/5q2/4n3/3KP3/2N3PN/PPP4P/R1BQ1B1R b kq - 0 1",
+    "2kr3r/pp1q1ppp/2n1pn2/3p4/3P4/2PBPN2/P1Q2PPP/R4RK1 w - - 4 13",
+    "r4rk1/pp2qppp/2n1pn2/2bp4/8/2NBPN2/PP1Q1PPP/R4RK1 w - - 0 12",
+    "8/8/8/8/5kp1/P7/8/1K1N4 w - - 0 1",
+    "8/8/8/5N2/8/p7/8/2NK3k w - - 0 1",
+    "8/3k4/8/8/8/4B3/4KB2/2B5 w - - 0 1",
+    "8/8/1P6/5pr1/8/4R3/7k/2K5 w - - 0 1",
+    "8/2p4P/8/kr6/6R1/8/8/1K6 w - - 0 1",
+    "8/8/3P3k/8/1p6/8/1P6/1K3n2 b - - 0 1",
+    "8/R7/2q5/8/6k1/8/1P5p/K6R w - - 0 124",
+    "8/k7/3p4/p2P1p2/P2P1P2/8/8/K7 w - - 0 1",
+    "8/8/4k3/8/2p5/8/B2P2K1/8 w - - 0 1",
+    "6k1/5ppp/8/8/8/8/5PPP/3R2K1 w - - 0 1",
+    "8/p4pk1/1p4p1/3P4/8/1P3PP1/P4K2/8 w - - 0 30",
+    "8/1p3k2/p1p5/P1P5/1P6/4K3/8/8 w - - 0 1",
+    "4k3/8/8/8/8/8/4P3/4K3 w - - 0 1",
+    "8/8/8/8/8/6k1/6p1/6K1 w - - 0 1",
+    "7k/7P/6K1/8/3B4/8/8/8 b - - 0 1",
+    "2r3k1/5ppp/8/8/8/8/5PPP/2R3K1 b - - 0 1",
+    "rnb1kbnr/pppp1ppp/8/4p3/6Pq/5P2/PPPPP2P/RNBQKBNR w KQkq - 1 3",
+    "7k/5K2/6Q1/8/8/8/8/8 b - - 0 1",
+};
+
+// Search every bench position to depth from an empty transposition table
+// and fresh thread tables. With one thread the total node count depends
+// only on what the search does, so it is a signature: a change that keeps
+// it is a pure speedup (or slowdown), one that alters it changed behaviour.
+void bench(int depth) {
+  u64 total = 0;
+  double total_secs = 0;
+  usize n = sizeof(bench_fens) / sizeof(bench_fens[0]);
+  for (usize i = 0; i < n; ++i) {
+    board_t bd;
+    init_board_from_fen(&bd, bench_fens[i]);
+    tt_clear(&tt);
+    threads_clear();
+
+    double start = now_seconds();
+    search_t *s = threads_search(
+        &bd, NULL, (search_limits_t){.depth = depth, .quiet = true});
+    double secs = now_seconds() - start;
+    u64 nodes = threads_nodes();
+    total += nodes;
+    total_secs += secs;
+
+    char mv[8] = "(none)";
+    if (s->pv.size)
+      move_to_uci(s->pv.moves[0], mv);
+    printf("%2zu/%zu bestmove %s score %d %s\n", i + 1, n, mv, s->score,
+           bench_fens[i]);
+  }
+
+  printf("total: ");
+  print_perft_stats(total, total_secs);
+  printf("signature %llu\n", (unsigned long long)total);
+}
+
+/* =========================
+   Batch analysis
+   ========================= */
+
+// Searches every position of an EPD or FEN file, one per line, on all
+// threads at once, each with its own board and search tables. The calling
+// thread reads lines into a rolling window of EPD_WINDOW slots, which the
+// pool threads take in order as each one comes free, so a slow position
+// holds up no thread but its own. Results are printed in input order: the
+// thread that completes the first line not yet printed prints the run of
+// done lines from there, freeing their slots for the reader.
+
+#define EPD_WINDOW 4096
+
+static inline bool epd_is_comment(const char *line) {
+  line += strspn(line, " \t");
+  return !*line || *line == '#';
+}
+
+typedef struct epd_result_t {
+  bool valid; // a position with both kings, the side not to move not in check
+  move_t best;
+  int score;
+  u64 nodes;
+} epd_result_t;
+
+typedef struct epd_slot_t {
+  char *line; // kept, with its capacity, for the lines to come
+  usize cap;
+  bool done; // under lock
+  epd_result_t result;
+} epd_slot_t;
+
+static struct {
+  epd_slot_t slots[EPD_WINDOW]; // line i in slots[i % EPD_WINDOW]
+  search_limits_t limits;
+  pthread_mutex_t lock;
+  pthread_cond_t more;  // a line was read, or the input ended
+  pthread_cond_t freed; // lines were printed
+  // Under lock: lines read into their slot, taken by a thread and printed
+  usize read, taken, printed;
+  bool eof;
+  usize positions; // printed so far, and their nodes
+  u64 nodes;
+} epd_job = {.lock = PTHREAD_MUTEX_INITIALIZER,
+             .more = PTHREAD_COND_INITIALIZER,
+             .freed = PTHREAD_COND_INITIALIZER};
+
+// Both kings on the board and the side that just moved not left in check
+static bool board_is_playable(const board_t *bd) {
+  bool us = bd->next_to_move;
+  return bd->king_sq[WHITE] != NO_SQUARE && bd->king_sq[BLACK] != NO_SQUARE &&
+         !is_attacked(bd, idx_v2(bd->king_sq[!us]), us);
+}
+
+static void epd_search(search_t *s, const char *line, epd_result_t *r) {
+  r->valid = !epd_is_comment(line) && init_board_from_fen(&s->bd, line) &&
+             board_is_playable(&s->bd);
+  if (!r->valid)
+    return;
+  s->limits = epd_job.limits;
+  s->start = now_seconds();
+  tt_new_search(&tt);
+  iterate(s);
+  r->best = s->pv.size ? s->pv.moves[0] : MOVE_NONE;
+  r->score = s->score;
+  r->nodes = s->nodes;
+}
+
+// The line of slot and its result, under lock
+static void epd_print(const epd_slot_t *slot) {
+  const epd_result_t *r = &slot->result;
+  char tail[96];
+  usize len = 0;
+  if (r->valid) {
+    char mv[6] = "0000";
+    if (r->best)
+      move_to_uci(r->best, mv);
+    len = (usize)sprintf(tail, " ; bestmove %s ; score ", mv);
+    len += score_to_uci(r->score, tail + len);
+    len += (usize)sprintf(tail + len, " ; nodes %llu",
+                          (unsigned long long)r->nodes);
+    epd_job.positions++;
+    epd_job.nodes += r->nodes;
+  } else if (!epd_is_comment(slot->line)) {
+    len = (usize)sprintf(tail, " ; invalid position");
+  }
+  tail[len++] = '\n';
+  fputs(slot->line, stdout);
+  fwrite(tail, 1, len, stdout);
+}
+
+static void epd_worker(int id) {
+  search_t *s = threads.workers[id];
+  s->id = 0; // no depth skipping, the positions are all different
+  s->solo = true;
+  s->nnue = use_nnue;
+  s->tt = &tt;
+  s->pondering = false;
+  s->root_keys = 0;
+
+  pthread_mutex_lock(&epd_job.lock);
+  for (;;) {
+    while (epd_job.taken == epd_job.read && !epd_job.eof)
+      pthread_cond_wait(&epd_job.more, &epd_job.lock);
+    if (epd_job.taken == epd_job.read)
+      break;
+    epd_slot_t *slot = &epd_job.slots[epd_job.taken++ % EPD_WINDOW];
+    pthread_mutex_unlock(&epd_job.lock);
+    epd_search(s, slot->line, &slot->result);
+    pthread_mutex_lock(&epd_job.lock);
+    slot->done = true;
+    if (slot == &epd_job.slots[epd_job.printed % EPD_WINDOW]) {
+      do
+        epd_print(&epd_job.slots[epd_job.printed++ % EPD_WINDOW]);
+      while (epd_job.printed < epd_job.read &&
+             epd_job.slots[epd_job.printed % EPD_WINDOW].done);
+      fflush(stdout);
+      pthread_cond_signal(&epd_job.freed);
+    }
+  }
+  pthread_mutex_unlock(&epd_job.lock);
+}
+
+// Search every line of in within limits and print, in order, each line
+// followed by the best move, its score and the nodes searched. Blank lines
+// and # comments are copied through. Returns the number of positions.
+usize epd_batch(FILE *in, search_limits_t limits) {
+  static char out_buf[1 << 20];
+  setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+  epd_job.limits = limits;
+  epd_job.limits.quiet = true;
+  epd_job.read = epd_job.taken = epd_job.printed = 0;
+  epd_job.eof = false;
+  epd_job.positions = 0;
+  epd_job.nodes = 0;
+
+  double start = now_seconds();
+  threads_start(epd_worker);
+  pthread_mutex_lock(&epd_job.lock);
+  while (!epd_job.eof) {
+    while (epd_job.read == epd_job.printed + EPD_WINDOW)
+      pthread_cond_wait(&epd_job.freed, &epd_job.lock);
+    // A free slot: no worker looks at it until read moves past it
+    epd_slot_t *slot = &epd_job.slots[epd_job.read % EPD_WINDOW];
+    pthread_mutex_unlock(&epd_job.lock);
+    isize len = getline(&slot->line, &slot->cap, in);
+    if (len >= 0)
+      slot->line[strcspn(slot->line, "\r\n")] = '\0';
+    pthread_mutex_lock(&epd_job.lock);
+    slot->done = false;
+    if (len < 0) {
+      epd_job.eof = true;
+      pthread_cond_broadcast(&epd_job.more);
+    } else {
+      epd_job.read++;
+      pthread_cond_signal(&epd_job.more);
+    }
+  }
+  pthread_mutex_unlock(&epd_job.lock);
+  threads_wait(); // the last line done prints whatever is left
+
+  double secs = now_seconds() - start;
+  u64 nodes = epd_job.nodes;
+  fprintf(stderr, "%zu positions, %llu nodes, %.3fs, %.0f nps\n",
+          epd_job.positions, (unsigned long long)nodes, secs,
+          secs > 0 ? nodes / secs : 0.0);
+  return epd_job.positions;
+}
+
+/* =========================
+   Opening book (Polyglot)
+   ========================= */
+
+// A Polyglot .bin book is a sorted array of 16 byte big-endian entries:
+// position key, move, weight and learning data. The file is mapped, not
+// read, so opening a book of any size costs nothing until it is probed,
+// and a probe touches only the pages of a binary search.
+
+// Random64 from the Polyglot book format: 12 x 64 piece-square keys (black
+// pawn, white pawn, black knight, ... on a1..h8), 4 castling rights, 8 en
+// passant files and the side to move
+static const u64 polyglot_random[781] = {
+    0x9D39247E33776D41ULL, 0x2AF7398005AAA5C7ULL, 0x44DB015024623547ULL,
+    0x9C15F73E62A76AE2ULL, 0x75834465489C0C89ULL, 0x3290AC3A203001BFULL,
+    0x0FBBAD1F61042279ULL, 0xE83A908FF2FB60CAULL, 0x0D7E765D58755C10ULL,
+    0x1A083822CEAFE02DULL, 0x9605D5F0E25EC3B0ULL, 0xD021FF5CD13A2ED5ULL,
+    0x40BDF15D4A672E32ULL, 0x011355146FD56395ULL, 0x5DB4832046F3D9E5ULL,
+    0x239F8B2D7FF719CCULL, 0x05D1A1AE85B49AA1ULL, 0x679F848F6E8FC971ULL,
+    0x7449BBFF801FED0BULL, 0x7D11CDB1C3B7ADF0ULL, 0x82C7709E781EB7CCULL,
+    0xF3218F1C9510786CULL, 0x331478F3AF51BBE6ULL, 0x4BB38DE5E7219443ULL,
+    0xAA649C6EBCFD50FCULL, 0x8DBD98A352AFD40BULL, 0x87D2074B81D79217ULL,
+    0x19F3C751D3E92AE1ULL, 0xB4AB30F062B19ABFULL, 0x7B0500AC42047AC4ULL,
+    0xC9452CA81A09D85DULL, 0x24AA6C514DA27500ULL, 0x4C9F34427501B447ULL,
+    0x14A68FD73C910841ULL, 0xA71B9B83461CBD93ULL, 0x03488B95B0F1850FULL,
+    0x637B2B34FF93C040ULL, 0x09D1BC9A3DD90A94ULL, 0x3575668334A1DD3BULL,
+    0x735E2B97A4C45A23ULL, 0x18727070F1BD400BULL, 0x1FCBACD259BF02E7ULL,
+    0xD310A7C2CE9B6555ULL, 0xBF983FE0FE5D8244ULL, 0x9F74D14F7454A824ULL,
+    0x51EBDC4AB9BA3035ULL, 0x5C82C505DB9AB0FAULL, 0xFCF7FE8A3430B241ULL,
+    0x3253A729B9BA3DDEULL, 0x8C74C368081B3075ULL, 0xB9BC6C87167C33E7ULL,
+    0x7EF48F2B83024E20ULL, 0x11D505D4C351BD7FULL, 0x6568FCA92C76A243ULL,
+    0x4DE0B0F40F32A7B8ULL, 0x96D693460CC37E5DULL, 0x42E240CB63689F2FULL,
+    0x6D2BDCDAE2919661ULL, 0x42880B0236E4D951ULL, 0x5F0F4A5898171BB6ULL,
+    0x39F890F579F92F88ULL, 0x93C5B5F47356388BULL, 0x63DC359D8D231B78ULL,
+    0xEC16CA8AEA98AD76ULL, 0x5355F900C2A82DC7ULL, 0x07FB9F855A997142ULL,
+    0x5093417AA8A7ED5EULL, 0x7BCBC38DA25A7F3CULL, 0x19FC8A768CF4B6D4ULL,
+    0x637A7780DECFC0D9ULL, 0x8249A47AEE0E41F7ULL, 0x79AD695501E7D1E8ULL,
+    0x14ACBAF4777D5776ULL, 0xF145B6BECCDEA195ULL, 0xDABF2AC8201752FCULL,
+    0x24C3C94DF9C8D3F6ULL, 0xBB6E2924F03912EAULL, 0x0CE26C0B95C980D9ULL,
+    0xA49CD132BFBF7CC4ULL, 0xE99D662AF4243939ULL, 0x27E6AD7891165C3FULL,
+    0x8535F040B9744FF1ULL, 0x54B3F4FA5F40D873ULL, 0x72B12C32127FED2BULL,
+    0xEE954D3C7B411F47ULL, 0x9A85AC909A24EAA1ULL, 0x70AC4CD9F04F21F5ULL,
+    0xF9B89D3E99A075C2ULL, 0x87B3E2B2B5C907B1ULL, 0xA366E5B8C54F48B8ULL,
+    0xAE4A9346CC3F7CF2ULL, 0x1920C04D47267BBDULL, 0x87BF02C6B49E2AE9ULL,
+    0x092237AC237F3859ULL, 0xFF07F64EF8ED14D0ULL, 0x8DE8DCA9F03CC54EULL,
+    0x9C1633264DB49C89ULL, 0xB3F22C3D0B0B38EDULL, 0x390E5FB44D01144BULL,
+    0x5BFEA5B4712768E9ULL, 0x1E1032911FA78984ULL, 0x9A74ACB964E78CB3ULL,
+    0x4F80F7A035DAFB04ULL, 0x6304D09A0B3738C4ULL, 0x2171E64683023A08ULL,
+    0x5B9B63EB9CEFF80CULL, 0x506AACF489889342ULL, 0x1881AFC9A3A701D6ULL,
+    0x6503080440750644ULL, 0xDFD395339CDBF4A7ULL, 0xEF927DBCF00C20F2ULL,
+    0x7B32F7D1E03680ECULL, 0xB9FD7620E7316243ULL, 0x05A7E8A57DB91B77ULL,
+    0xB5889C6E15630A75ULL, 0x4A750A09CE9573F7ULL, 0xCF464CEC899A2F8AULL,
+    0xF538639CE705B824ULL, 0x3C79A0FF5580EF7FULL, 0xEDE6C87F8477609DULL,
+    0x799E81F05BC93F31ULL, 0x86536B8CF3428A8CULL, 0x97D7374C60087B73ULL,
+    0xA246637CFF328532ULL, 0x043FCAE60CC0EBA0ULL, 0x920E449535DD359EULL,
+    0x70EB093B15B290CCULL, 0x73A1921916591CBDULL, 0x56436C9FE1A1AA8DULL,
+    0xEFAC4B70633B8F81ULL, 0xBB215798D45DF7AFULL, 0x45F20042F24F1768ULL,
+    0x930F80F4E8EB7462ULL, 0xFF6712FFCFD75EA1ULL, 0xAE623FD67468AA70ULL,
+    0xDD2C5BC84BC8D8FCULL, 0x7EED120D54CF2DD9ULL, 0x22FE545401165F1CULL,
+    0xC91800E98FB99929ULL, 0x808BD68E6AC10365ULL, 0xDEC468145B7605F6ULL,
+    0x1BEDE3A3AEF53302ULL, 0x43539603D6C55602ULL, 0xAA969B5C691CCB7AULL,
+    0xA87832D392EFEE56ULL, 0x65942C7B3C7E11AEULL, 0xDED2D633CAD004F6ULL,
+    0x21F08570F420E565ULL, 0xB415938D7DA94E3CULL, 0x91B859E59ECB6350ULL,
+    0x10CFF333E0ED804AULL, 0x28AED140BE0BB7DDULL, 0xC5CC1D89724FA456ULL,
+    0x5648F680F11A2741ULL, 0x2D255069F0B7DAB3ULL, 0x9BC5A38EF729ABD4ULL,
+    0xEF2F054308F6A2BCULL, 0xAF2042F5CC5C2858ULL, 0x480412BAB7F5BE2AULL,
+    0xAEF3AF4A563DFE43ULL, 0x19AFE59AE451497FULL, 0x52593803DFF1E840ULL,
+    0xF4F076E65F2CE6F0ULL, 0x11379625747D5AF3ULL, 0xBCE5D2248682C115ULL,
+    0x9DA4243DE836994FULL, 0x066F70B33FE09017ULL, 0x4DC4DE189B671A1CULL,
+    0x51039AB7712457C3ULL, 0xC07A3F80C31FB4B4ULL, 0xB46EE9C5E64A6E7CULL,
+    0xB3819A42ABE61C87ULL, 0x21A007933A522A20ULL, 0x2DF16F761598AA4FULL,
+    0x763C4A1371B368FDULL, 0xF793C46702E086A0ULL, 0xD7288E012AEB8D31ULL,
+    0xDE336A2A4BC1C44BULL, 0x0BF692B38D079F23ULL, 0x2C604A7A177326B3ULL,
+    0x4850E73E03EB6064ULL, 0xCFC447F1E53C8E1BULL, 0xB05CA3F564268D99ULL,
+    0x9AE182C8BC9474E8ULL, 0xA4FC4BD4FC5558CAULL, 0xE755178D58FC4E76ULL,
+    0x69B97DB1A4C03DFEULL, 0xF9B5B7C4ACC67C96ULL, 0xFC6A82D64B8655FBULL,
+    0x9C684CB6C4D24417ULL, 0x8EC97D2917456ED0ULL, 0x6703DF9D2924E97EULL,
+    0xC547F57E42A7444EULL, 0x78E37644E7CAD29EULL, 0xFE9A44E9362F05FAULL,
+    0x08BD35CC38336615ULL, 0x9315E5EB3A129ACEULL, 0x94061B871E04DF75ULL,
+    0xDF1D9F9D784BA010ULL, 0x3BBA57B68871B59DULL, 0xD2B7ADEEDED1F73FULL,
+    0xF7A255D83BC373F8ULL, 0xD7F4F2448C0CEB81ULL, 0xD95BE88CD210FFA7ULL,
+    0x336F52F8FF4728E7ULL, 0xA74049DAC312AC71ULL, 0xA2F61BB6E437FDB5ULL,
+    0x4F2A5CB07F6A35B3ULL, 0x87D380BDA5BF7859ULL, 0x16B9F7E06C453A21ULL,
+    0x7BA2484C8A0FD54EULL, 0xF3A678CAD9A2E38CULL, 0x39B0BF7DDE437BA2ULL,
+    0xFCAF55C1BF8A4424ULL, 0x18FCF680573FA594ULL, 0x4C0563B89F495AC3ULL,
+    0x40E087931A00930DULL, 0x8CFFA9412EB642C1ULL, 0x68CA39053261169FULL,
+    0x7A1EE967D27579E2ULL, 0x9D1D60E5076F5B6FULL, 0x3810E399B6F65BA2ULL,
+    0x32095B6D4AB5F9B1ULL, 0x35CAB62109DD038AULL, 0xA90B24499FCFAFB1ULL,
+    0x77A225A07CC2C6BDULL, 0x513E5E634C70E331ULL, 0x4361C0CA3F692F12ULL,
+    0xD941ACA44B20A45BULL, 0x528F7C8602C5807BULL, 0x52AB92BEB9613989ULL,
+    0x9D1DFA2EFC557F73ULL, 0x722FF175F572C348ULL, 0x1D1260A51107FE97ULL,
+    0x7A249A57EC0C9BA2ULL, 0x04208FE9E8F7F2D6ULL, 0x5A110C6058B920A0ULL,
+    0x0CD9A497658A5698ULL, 0x56FD23C8F9715A4CULL, 0x284C847B9D887AAEULL,
+    0x04FEABFBBDB619CBULL, 0x742E1E651C60BA83ULL, 0x9A9632E65904AD3CULL,
+    0x881B82A13B51B9E2ULL, 0x506E6744CD974924ULL, 0xB0183DB56FFC6A79ULL,
+    0x0ED9B915C66ED37EULL, 0x5E11E86D5873D484ULL, 0xF678647E3519AC6EULL,
+    0x1B85D488D0F20CC5ULL, 0xDAB9FE6525D89021ULL, 0x0D151D86ADB73615ULL,
+    0xA865A54EDCC0F019ULL, 0x93C42566AEF98FFBULL, 0x99E7AFEABE000731ULL,
+    0x48CBFF086DDF285AULL, 0x7F9B6AF1EBF78BAFULL, 0x58627E1A149BBA21ULL,
+    0x2CD16E2ABD791E33ULL, 0xD363EFF5F0977996ULL, 0x0CE2A38C344A6EEDULL,
+    0x1A804AADB9CFA741ULL, 0x907F30421D78C5DEULL, 0x501F65EDB3034D07ULL,
+    0x37624AE5A48FA6E9ULL, 0x957BAF61700CFF4EULL, 0x3A6C27934E31188AULL,
+    0xD49503536ABCA345ULL, 0x088E049589C432E0ULL, 0xF943AEE7FEBF21B8ULL,
+    0x6C3B8E3E336139D3ULL, 0x364F6FFA464EE52EULL, 0xD60F6DCEDC314222ULL,
+    0x56963B0DCA418FC0ULL, 0x16F50EDF91E513AFULL, 0xEF1955914B609F93ULL,
+    0x565601C0364E3228ULL, 0xECB53939887E8175ULL, 0xBAC7A9A18531294BULL,
+    0xB344C470397BBA52ULL, 0x65D34954DAF3CEBDULL, 0xB4B81B3FA97511E2ULL,
+    0xB422061193D6F6A7ULL, 0x071582401C38434DULL, 0x7A13F18BBEDC4FF5ULL,
+    0xBC4097B116C524D2ULL, 0x59B97885E2F2EA28ULL, 0x99170A5DC3115544ULL,
+    0x6F423357E7C6A9F9ULL, 0x325928EE6E6F8794ULL, 0xD0E4366228B03343ULL,
+    0x565C31F7DE89EA27ULL, 0x30F5611484119414ULL, 0xD873DB391292ED4FULL,
+    0x7BD94E1D8E17DEBCULL, 0xC7D9F16864A76E94ULL, 0x947AE053EE56E63CULL,
+    0xC8C93882F9475F5FULL, 0x3A9BF55BA91F81CAULL, 0xD9A11FBB3D9808E4ULL,
+    0x0FD22063EDC29FCAULL, 0xB3F256D8ACA0B0B9ULL, 0xB03031A8B4516E84ULL,
+    0x35DD37D5871448AFULL, 0xE9F6082B05542E4EULL, 0xEBFAFA33D7254B59ULL,
+    0x9255ABB50D532280ULL, 0xB9AB4CE57F2D34F3ULL, 0x693501D628297551ULL,
+    0xC62C58F97DD949BFULL, 0xCD454F8F19C5126AULL, 0xBBE83F4ECC2BDECBULL,
+    0xDC842B7E2819E230ULL, 0xBA89142E007503B8ULL, 0xA3BC941D0A5061CBULL,
+    0xE9F6760E32CD8021ULL, 0x09C7E552BC76492FULL, 0x852F54934DA55CC9ULL,
+    0x8107FCCF064FCF56ULL, 0x098954D51FFF6580ULL, 0x23B70EDB1955C4BFULL,
+    0xC330DE426430F69DULL, 0x4715ED43E8A45C0AULL, 0xA8D7E4DAB780A08DULL,
+    0x0572B974F03CE0BBULL, 0xB57D2E985E1419C7ULL, 0xE8D9ECBE2CF3D73FULL,
+    0x2FE4B17170E59750ULL, 0x11317BA87905E790ULL, 0x7FBF21EC8A1F45ECULL,
+    0x1725CABFCB045B00ULL, 0x964E915CD5E2B207ULL, 0x3E2B8BCBF016D66DULL,
+    0xBE7444E39328A0ACULL, 0xF85B2B4FBCDE44B7ULL, 0x49353FEA39BA63B1ULL,
+    0x1DD01AAFCD53486AULL, 0x1FCA8A92FD719F85ULL, 0xFC7C95D827357AFAULL,
+    0x18A6A990C8B35EBDULL, 0xCCCB7005C6B9C28DULL, 0x3BDBB92C43B17F26ULL,
+    0xAA70B5B4F89695A2ULL, 0xE94C39A54A98307FULL, 0xB7A0B174CFF6F36EULL,
+    0xD4DBA84729AF48ADULL, 0x2E18BC1AD9704A68ULL, 0x2DE0966DAF2F8B1CULL,
+    0xB9C11D5B1E43A07EULL, 0x64972D68DEE33360ULL, 0x94628D38D0C20584ULL,
+    0xDBC0D2B6AB90A559ULL, 0xD2733C4335C6A72FULL, 0x7E75D99D94A70F4DULL,
+    0x6CED1983376FA72BULL, 0x97FCAACBF030BC24ULL, 0x7B77497B32503B12ULL,
+    0x8547EDDFB81CCB94ULL, 0x79999CDFF70902CBULL, 0xCFFE1939438E9B24ULL,
+    0x829626E3892D95D7ULL, 0x92FAE24291F2B3F1ULL, 0x63E22C147B9C3403ULL,
+    0xC678B6D860284A1CULL, 0x5873888850659AE7ULL, 0x0981DCD296A8736DULL,
+    0x9F65789A6509A440ULL, 0x9FF38FED72E9052FULL, 0xE479EE5B9930578CULL,
+    0xE7F28ECD2D49EECDULL, 0x56C074A581EA17FEULL, 0x5544F7D774B14AEFULL,
+    0x7B3F0195FC6F290FULL, 0x12153635B2C0CF57ULL, 0x7F5126DBBA5E0CA7ULL,
+    0x7A76956C3EAFB413ULL, 0x3D5774A11D31AB39ULL, 0x8A1B083821F40CB4ULL,
+    0x7B4A38E32537DF62ULL, 0x950113646D1D6E03ULL, 0x4DA8979A0041E8A9ULL,
+    0x3BC36E078F7515D7ULL, 0x5D0A12F27AD310D1ULL, 0x7F9D1A2E1EBE1327ULL,
+    0xDA3A361B1C5157B1ULL, 0xDCDD7D20903D0C25ULL, 0x36833336D068F707ULL,
+    0xCE68341F79893389ULL, 0xAB9090168DD05F34ULL, 0x43954B3252DC25E5ULL,
+    0xB438C2B67F98E5E9ULL, 0x10DCD78E3851A492ULL, 0xDBC27AB5447822BFULL,
+    0x9B3CDB65F82CA382ULL, 0xB67B7896167B4C84ULL, 0xBFCED1B0048EAC50ULL,
+    0xA9119B60369FFEBDULL, 0x1FFF7AC80904BF45ULL, 0xAC12FB171817EEE7ULL,
+    0xAF08DA9177DDA93DULL, 0x1B0CAB936E65C744ULL, 0xB559EB1D04E5E932ULL,
+    0xC37B45B3F8D6F2BAULL, 0xC3A9DC228CAAC9E9ULL, 0xF3B8B6675A6507FFULL,
+    0x9FC477DE4ED681DAULL, 0x67378D8ECCEF96CBULL, 0x6DD856D94D259236ULL,
+    0xA319CE15B0B4DB31ULL, 0x073973751F12DD5EULL, 0x8A8E849EB32781A5ULL,
+    0xE1925C71285279F5ULL, 0x74C04BF1790C0EFEULL, 0x4DDA48153C94938AULL,
+    0x9D266D6A1CC0542CULL, 0x7440FB816508C4FEULL, 0x13328503DF48229FULL,
+    0xD6BF7BAEE43CAC40ULL, 0x4838D65F6EF6748FULL, 0x1E152328F3318DEAULL,
+    0x8F8419A348F296BFULL, 0x72C8834A5957B511ULL, 0xD7A023A73260B45CULL,
+    0x94EBC8ABCFB56DAEULL, 0x9FC10D0F989993E0ULL, 0xDE68A2355B93CAE6ULL,
+    0xA44CFE79AE538BBEULL, 0x9D1D84FCCE371425ULL, 0x51D2B1AB2DDFB636ULL,
+    0x2FD7E4B9E72CD38CULL, 0x65CA5B96B7552210ULL, 0xDD69A0D8AB3B546DULL,
+    0x604D51B25FBF70E2ULL, 0x73AA8A564FB7AC9EULL, 0x1A8C1E992B941148ULL,
+    0xAAC40A2703D9BEA0ULL, 0x764DBEAE7FA4F3A6ULL, 0x1E99B96E70A9BE8BULL,
+    0x2C5E9DEB57EF4743ULL, 0x3A938FEE32D29981ULL, 0x26E6DB8FFDF5ADFEULL,
+    0x469356C504EC9F9DULL, 0xC8763C5B08D1908CULL, 0x3F6C6AF859D80055ULL,
+    0x7F7CC39420A3A545ULL, 0x9BFB227EBDF4C5CEULL, 0x89039D79D6FC5C5CULL,
+    0x8FE88B57305E2AB6ULL, 0xA09E8C8C35AB96DEULL, 0xFA7E393983325753ULL,
+    0xD6B6D0ECC617C699ULL, 0xDFEA21EA9E7557E3ULL, 0xB67C1FA481680AF8ULL,
+    0xCA1E3785A9E724E5ULL, 0x1CFC8BED0D681639ULL, 0xD18D8549D140CAEAULL,
+    0x4ED0FE7E9DC91335ULL, 0xE4DBF0634473F5D2ULL, 0x1761F93A44D5AEFEULL,
+    0x53898E4C3910DA55ULL, 0x734DE8181F6EC39AULL, 0x2680B122BAA28D97ULL,
+    0x298AF231C85BAFABULL, 0x7983EED3740847D5ULL, 0x66C1A2A1A60CD889ULL,
+    0x9E17E49642A3E4C1ULL, 0xEDB454E7BADC0805ULL, 0x50B704CAB602C329ULL,
+    0x4CC317FB9CDDD023ULL, 0x66B4835D9EAFEA22ULL, 0x219B97E26FFC81BDULL,
+    0x261E4E4C0A333A9DULL, 0x1FE2CCA76517DB90ULL, 0xD7504DFA8816EDBBULL,
+    0xB9571FA04DC089C8ULL, 0x1DDC0325259B27DEULL, 0xCF3F4688801EB9AAULL,
+    0xF4F5D05C10CAB243ULL, 0x38B6525C21A42B0EULL, 0x36F60E2BA4FA6800ULL,
+    0xEB3593803173E0CEULL, 0x9C4CD6257C5A3603ULL, 0xAF0C317D32ADAA8AULL,
+    0x258E5A80C7204C4BULL, 0x8B889D624D44885DULL, 0xF4D14597E660F855ULL,
+    0xD4347F66EC8941C3ULL, 0xE699ED85B0DFB40DULL, 0x2472F6207C2D0484ULL,
+    0xC2A1E7B5B459AEB5ULL, 0xAB4F6451CC1D45ECULL, 0x63767572AE3D6174ULL,
+    0xA59E0BD101731A28ULL, 0x116D0016CB948F09ULL, 0x2CF9C8CA052F6E9FULL,
+    0x0B090A7560A968E3ULL, 0xABEEDDB2DDE06FF1ULL, 0x58EFC10B06A2068DULL,
+    0xC6E57A78FBD986E0ULL, 0x2EAB8CA63CE802D7ULL, 0x14A195640116F336ULL,
+    0x7C0828DD624EC390ULL, 0xD74BBE77E6116AC7ULL, 0x804456AF10F5FB53ULL,
+    0xEBE9EA2ADF4321C7ULL, 0x03219A39EE587A30ULL, 0x49787FEF17AF9924ULL,
+    0xA1E9300CD8520548ULL, 0x5B45E522E4B1B4EFULL, 0xB49C3B3995091A36ULL,
+    0xD4490AD526F14431ULL, 0x12A8F216AF9418C2ULL, 0x001F837CC7350524ULL,
+    0x1877B51E57A764D5ULL, 0xA2853B80F17F58EEULL, 0x993E1DE72D36D310ULL,
+    0xB3598080CE64A656ULL, 0x252F59CF0D9F04BBULL, 0xD23C8E176D113600ULL,
+    0x1BDA0492E7E4586EULL, 0x21E0BD5026C619BFULL, 0x3B097ADAF088F94EULL,
+    0x8D14DEDB30BE846EULL, 0xF95CFFA23AF5F6F4ULL, 0x3871700761B3F743ULL,
+    0xCA672B91E9E4FA16ULL, 0x64C8E531BFF53B55ULL, 0x241260ED4AD1E87DULL,
+    0x106C09B972D2E822ULL, 0x7FBA195410E5CA30ULL, 0x7884D9BC6CB569D8ULL,
+    0x0647DFEDCD894A29ULL, 0x63573FF03E224774ULL, 0x4FC8E9560F91B123ULL,
+    0x1DB956E450275779ULL, 0xB8D91274B9E9D4FBULL, 0xA2EBEE47E2FBFCE1ULL,
+    0xD9F1F30CCD97FB09ULL, 0xEFED53D75FD64E6BULL, 0x2E6D02C36017F67FULL,
+    0xA9AA4D20DB084E9BULL, 0xB64BE8D8B25396C1ULL, 0x70CB6AF7C2D5BCF0ULL,
+    0x98F076A4F7A2322EULL, 0xBF84470805E69B5FULL, 0x94C3251F06F90CF3ULL,
+    0x3E003E616A6591E9ULL, 0xB925A6CD0421AFF3ULL, 0x61BDD1307C66E300ULL,
+    0xBF8D5108E27E0D48ULL, 0x240AB57A8B888B20ULL, 0xFC87614BAF287E07ULL,
+    0xEF02CDD06FFDB432ULL, 0xA1082C0466DF6C0AULL, 0x8215E577001332C8ULL,
+    0xD39BB9C3A48DB6CFULL, 0x2738259634305C14ULL, 0x61CF4F94C97DF93DULL,
+    0x1B6BACA2AE4E125BULL, 0x758F450C88572E0BULL, 0x959F587D507A8359ULL,
+    0xB063E962E045F54DULL, 0x60E8ED72C0DFF5D1ULL, 0x7B64978555326F9FULL,
+    0xFD080D236DA814BAULL, 0x8C90FD9B083F4558ULL, 0x106F72FE81E2C590ULL,
+    0x7976033A39F7D952ULL, 0xA4EC0132764CA04BULL, 0x733EA705FAE4FA77ULL,
+    0xB4D8F77BC3E56167ULL, 0x9E21F4F903B33FD9ULL, 0x9D765E419FB69F6DULL,
+    0xD30C088BA61EA5EFULL, 0x5D94337FBFAF7F5BULL, 0x1A4E4822EB4D7A59ULL,
+    0x6FFE73E81B637FB3ULL, 0xDDF957BC36D8B9CAULL, 0x64D0E29EEA8838B3ULL,
+    0x08DD9BDFD96B9F63ULL, 0x087E79E5A57D1D13ULL, 0xE328E230E3E2B3FBULL,
+    0x1C2559E30F0946BEULL, 0x720BF5F26F4D2EAAULL, 0xB0774D261CC609DBULL,
+    0x443F64EC5A371195ULL, 0x4112CF68649A260EULL, 0xD813F2FAB7F5C5CAULL,
+    0x660D3257380841EEULL, 0x59AC2C7873F910A3ULL, 0xE846963877671A17ULL,
+    0x93B633ABFA3469F8ULL, 0xC0C0F5A60EF4CDCFULL, 0xCAF21ECD4377B28CULL,
+    0x57277707199B8175ULL, 0x506C11B9D90E8B1DULL, 0xD83CC2687A19255FULL,
+    0x4A29C6465A314CD1ULL, 0xED2DF21216235097ULL, 0xB5635C95FF7296E2ULL,
+    0x22AF003AB672E811ULL, 0x52E762596BF68235ULL, 0x9AEBA33AC6ECC6B0ULL,
+    0x944F6DE09134DFB6ULL, 0x6C47BEC883A7DE39ULL, 0x6AD047C430A12104ULL,
+    0xA5B1CFDBA0AB4067ULL, 0x7C45D833AFF07862ULL, 0x5092EF950A16DA0BULL,
+    0x9338E69C052B8E7BULL, 0x455A4B4CFE30E3F5ULL, 0x6B02E63195AD0CF8ULL,
+    0x6B17B224BAD6BF27ULL, 0xD1E0CCD25BB9C169ULL, 0xDE0C89A556B9AE70ULL,
+    0x50065E535A213CF6ULL, 0x9C1169FA2777B874ULL, 0x78EDEFD694AF1EEDULL,
+    0x6DC93D9526A50E68ULL, 0xEE97F453F06791EDULL, 0x32AB0EDB696703D3ULL,
+    0x3A6853C7E70757A7ULL, 0x31865CED6120F37DULL, 0x67FEF95D92607890ULL,
+    0x1F2B1D1F15F6DC9CULL, 0xB69E38A8965C6B65ULL, 0xAA9119FF184CCCF4ULL,
+    0xF43C732873F24C13ULL, 0xFB4A3D794A9A80D2ULL, 0x3550C2321FD6109CULL,
+    0x371F77E76BB8417EULL, 0x6BFA9AAE5EC05779ULL, 0xCD04F3FF001A4778ULL,
+    0xE3273522064480CAULL, 0x9F91508BFFCFC14AULL, 0x049A7F41061A9E60ULL,
+    0xFCB6BE43A9F2FE9BULL, 0x08DE8A1C7797DA9BULL, 0x8F9887E6078735A1ULL,
+    0xB5B4071DBFC73A66ULL, 0x230E343DFBA08D33ULL, 0x43ED7F5A0FAE657DULL,
+    0x3A88A0FBBCB05C63ULL, 0x21874B8B4D2DBC4FULL, 0x1BDEA12E35F6A8C9ULL,
+    0x53C065C6C8E63528ULL, 0xE34A1D250E7A8D6BULL, 0xD6B04D3B7651DD7EULL,
+    0x5E90277E7CB39E2DULL, 0x2C046F22062DC67DULL, 0xB10BB459132D0A26ULL,
+    0x3FA9DDFB67E2F199ULL, 0x0E09B88E1914F7AFULL, 0x10E8B35AF3EEAB37ULL,
+    0x9EEDECA8E272B933ULL, 0xD4C718BC4AE8AE5FULL, 0x81536D601170FC20ULL,
+    0x91B534F885818A06ULL, 0xEC8177F83F900978ULL, 0x190E714FADA5156EULL,
+    0xB592BF39B0364963ULL, 0x89C350C893AE7DC1ULL, 0xAC042E70F8B383F2ULL,
+    0xB49B52E587A1EE60ULL, 0xFB152FE3FF26DA89ULL, 0x3E666E6F69AE2C15ULL,
+    0x3B544EBE544C19F9ULL, 0xE805A1E290CF2456ULL, 0x24B33C9D7ED25117ULL,
+    0xE74733427B72F0C1ULL, 0x0A804D18B7097475ULL, 0x57E3306D881EDB4FULL,
+    0x4AE7D6A36EB5DBCBULL, 0x2D8D5432157064C8ULL, 0xD1E649DE1E7F268BULL,
+    0x8A328A1CEDFE552CULL, 0x07A3AEC79624C7DAULL, 0x84547DDC3E203C94ULL,
+    0x990A98FD5071D263ULL, 0x1A4FF12616EEFC89ULL, 0xF6F7FD1431714200ULL,
+    0x30C05B1BA332F41CULL, 0x8D2636B81555A786ULL, 0x46C9FEB55D120902ULL,
+    0xCCEC0A73B49C9921ULL, 0x4E9D2827355FC492ULL, 0x19EBB029435DCB0FULL,
+    0x4659D2B743848A2CULL, 0x963EF2C96B33BE31ULL, 0x74F85198B05A2E7DULL,
+    0x5A0F544DD2B1FB18ULL, 0x03727073C2E134B1ULL, 0xC7F6AA2DE59AEA61ULL,
+    0x352787BAA0D7C22FULL, 0x9853EAB63B5E0B35ULL, 0xABBDCDD7ED5C0860ULL,
+    0xCF05DAF5AC8D77B0ULL, 0x49CAD48CEBF4A71EULL, 0x7A4C10EC2158C4A6ULL,
+    0xD9E92AA246BF719EULL, 0x13AE978D09FE5557ULL, 0x730499AF921549FFULL,
+    0x4E4B705B92903BA4ULL, 0xFF577222C14F0A3AULL, 0x55B6344CF97AAFAEULL,
+    0xB862225B055B6960ULL, 0xCAC09AFBDDD2CDB4ULL, 0xDAF8E9829FE96B5FULL,
+    0xB5FDFC5D3132C498ULL, 0x310CB380DB6F7503ULL, 0xE87FBB46217A360EULL,
+    0x2102AE466EBB1148ULL, 0xF8549E1A3AA5E00DULL, 0x07A69AFDCC42261AULL,
+    0xC4C118BFE78FEAAEULL, 0xF9F4892ED96BD438ULL, 0x1AF3DBE25D8F45DAULL,
+    0xF5B4B0B0D2DEEEB4ULL, 0x962ACEEFA82E1C84ULL, 0x046E3ECAAF453CE9ULL,
+    0xF05D129681949A4CULL, 0x964781CE734B3C84ULL, 0x9C2ED44081CE5FBDULL,
+    0x522E23F3925E319EULL, 0x177E00F9FC32F791ULL, 0x2BC60A63A6F3B3F2ULL,
+    0x222BBFAE61725606ULL, 0x486289DDCC3D6780ULL, 0x7DC7785B8EFDFC80ULL,
+    0x8AF38731C02BA980ULL, 0x1FAB64EA29A2DDF7ULL, 0xE4D9429322CD065AULL,
+    0x9DA058C67844F20CULL, 0x24C0E332B70019B0ULL, 0x233003B5A6CFE6ADULL,
+    0xD586BD01C5C217F6ULL, 0x5E5637885F29BC2BULL, 0x7EBA726D8C94094BULL,
+    0x0A56A5F0BFE39272ULL, 0xD79476A84EE20D06ULL, 0x9E4C1269BAA4BF37ULL,
+    0x17EFEE45B0DEE640ULL, 0x1D95B0A5FCF90BC6ULL, 0x93CBE0B699C2585DULL,
+    0x65FA4F227A2B6D79ULL, 0xD5F9E858292504D5ULL, 0xC2B5A03F71471A6FULL,
+    0x59300222B4561E00ULL, 0xCE2F8642CA0712DCULL, 0x7CA9723FBB2E8988ULL,
+    0x2785338347F2BA08ULL, 0xC61BB3A141E50E8CULL, 0x150F361DAB9DEC26ULL,
+    0x9F6A419D382595F4ULL, 0x64A53DC924FE7AC9ULL, 0x142DE49FFF7A7C3DULL,
+    0x0C335248857FA9E7ULL, 0x0A9C32D5EAE45305ULL, 0xE6C42178C4BBB92EULL,
+    0x71F1CE2490D20B07ULL, 0xF1BCC3D275AFE51AULL, 0xE728E8C83C334074ULL,
+    0x96FBF83A12884624ULL, 0x81A1549FD6573DA5ULL, 0x5FA7867CAF35E149ULL,
+    0x56986E2EF3ED091BULL, 0x917F1DD5F8886C61ULL, 0xD20D8C88C8FFE65FULL,
+    0x31D71DCE64B2C310ULL, 0xF165B587DF898190ULL, 0xA57E6339DD2CF3A0ULL,
+    0x1EF6E6DBB1961EC9ULL, 0x70CC73D90BC26E24ULL, 0xE21A6B35DF0C3AD7ULL,
+    0x003A93D8B2806962ULL, 0x1C99DED33CB890A1ULL, 0xCF3145DE0ADD4289ULL,
+    0xD0E4427A5514FB72ULL, 0x77C621CC9FB3A483ULL, 0x67A34DAC4356550BULL,
+    0xF8D626AAAF278509ULL,
+};
+
+#define BOOK_ENTRY_SIZE 16
+
+static struct {
+  const u8 *map; // NULL without a book
+  usize size;
+  usize count;
+  u64 seed; // for picking among the moves of a position
+} book;
+
+static inline u64 read_be(const u8 *p, int bytes) {
+  u64 v = 0;
+  for (int i = 0; i < bytes; ++i)
+    v = v << 8 | p[i];
+  return v;
+}
+
+// Position key in the Polyglot scheme, which differs from compute_key
+u64 polyglot_key(const board_t *bd) {
+  u64 key = 0;
+  for (u64 occ = bd->occupied; occ;) {
+    u8 sq = pop_lsb(&occ);
+    piece_t pc = piece_at(bd, sq);
+    int kind = 2 * (pc.id - 1) + (pc.color == WHITE); // black pawn first
+    key ^= polyglot_random[64 * kind + sq];
+  }
+  static const u8 rights[4] = {CASTLE_WK, CASTLE_WQ, CASTLE_BK, CASTLE_BQ};
+  for (int i = 0; i < 4; ++i)
+    if (bd->st.castling & rights[i])
+      key ^= polyglot_random[768 + i];
+  // The en passant file counts only if a pawn can actually take there
+  if (bd->st.ep_square != NO_SQUARE &&
+      (pawn_attacks(bd->st.ep_square, !bd->next_to_move) &
+       bd->pieces[PAWN] & bd->colors[bd->next_to_move]))
+    key ^= polyglot_random[772 + bd->st.ep_square % WIDTH];
+  if (bd->next_to_move == WHITE)
+    key ^= polyglot_random[780];
+  return key;
+}
+
+// Map the book at path, replacing the current one
+bool book_load(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !st.st_size || st.st_size % BOOK_ENTRY_SIZE) {
+    fprintf(stderr, "%s: not a Polyglot book\n", path);
+    close(fd);
+    return false;
+  }
+  u8 *map = mmap(NULL, (usize)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror(path);
+    return false;
+  }
+  madvise(map, (usize)st.st_size, MADV_RANDOM); // no readahead for probes
+
+  if (book.map)
+    munmap((void *)book.map, book.size);
+  book.map = map;
+  book.size = (usize)st.st_size;
+  book.count = book.size / BOOK_ENTRY_SIZE;
+  book.seed = (u64)(now_seconds() * 1e9) | 1;
+  return true;
+}
+
+void book_close(void) {
+  if (book.map)
+    munmap((void *)book.map, book.size);
+  book.map = NULL;
+}
+
+// Book move for bd, picked at random in proportion to the entry weights.
+// False if there is none, or if it is not legal here (a key collision).
+bool book_probe(const board_t *bd, move_t *mv) {
+  if (!book.map)
+    return false;
+  u64 key = polyglot_key(bd);
+
+  // First entry with this key
+  usize lo = 0, hi = book.count;
+  while (lo < hi) {
+    usize mid = lo + (hi - lo) / 2;
+    if (read_be(book.map + mid * BOOK_ENTRY_SIZE, 8) < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  u64 total = 0;
+  for (usize i = lo;
+       i < book.count && read_be(book.map + i * BOOK_ENTRY_SIZE, 8) == key; ++i)
+    total += read_be(book.map + i * BOOK_ENTRY_SIZE + 10, 2);
+  if (!total)
+    return false;
+
+  u64 pick = rand64(&book.seed) % total;
+  u16 raw = 0;
+  for (usize i = lo;; ++i) {
+    const u8 *e = book.map + i * BOOK_ENTRY_SIZE;
+    u64 weight = read_be(e + 10, 2);
+    if (pick < weight) {
+      raw = (u16)read_be(e + 8, 2);
+      break;
+    }
+    pick -= weight;
+  }
+
+  // to file/rank in bits 0-5, from in 6-11 (both a1 = 0, like ours),
+  // promotion in 12-14 as 1 knight .. 4 queen. Castling is written as
+  // the king taking its own rook.
+  u8 to = raw & 63, from = (raw >> 6) & 63, promo = (raw >> 12) & 7;
+  if (piece_at(bd, from).id == KING && piece_at(bd, to).id == ROOK &&
+      piece_at(bd, to).color == piece_at(bd, from).color)
+    to = to > from ? from + 2 : from - 2;
+
+  move_list_t legal;
+  list_legals(bd, &legal);
+  for (usize i = 0; i < legal.size; ++i) {
+    move_t m = legal.handle[i];
+    if (move_from(m) == from && move_to(m) == to &&
+        (promo ? move_promotion(m) == promo + 1 : !move_promotion(m))) {
+      *mv = m;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* =========================
+   UCI
+   ========================= */
+
+#define MOVE_OVERHEAD 0.03 // seconds lost per move to the GUI and pipes
+
+// Per-move budget from the clock: an even share of what is left (over
+// movestogo moves, or 30 if unknown) plus most of the increment. The search
+// stops starting new iterations past a part of that share and is cut off
+// at a few times it, never using more than most of the clock.
+void time_budget(search_limits_t *limits, double left, double inc,
+                 int movestogo) {
+  int mtg = movestogo > 0 && movestogo < 30 ? movestogo : 30;
+  double usable = left - MOVE_OVERHEAD;
+  if (usable < 0.005)
+    usable = 0.005;
+  double share = usable / mtg + inc * 0.75;
+  limits->time = share * 3 < usable * 0.8 ? share * 3 : usable * 0.8;
+  limits->soft_time =
+      share * 0.6 < limits->time ? share * 0.6 : limits->time;
+}
+
+// Find the legal move written in UCI notation (e2e4, e7e8q) on bd
+bool parse_uci_move(board_t *bd, const char *str, move_t *mv) {
+  if (strlen(str) < 4 || str[0] < 'a' || str[0] > 'h' || str[1] < '1' ||
+      str[1] > '8' || str[2] < 'a' || str[2] > 'h' || str[3] < '1' ||
+      str[3] > '8')
+    return false;
+  u8 from = sq_idx(str), to = sq_idx(str + 2);
+  u8 promotion = str[4] ? fen_piece_id(str[4]) : 0;
+
+  move_list_t legal;
+  list_legals(bd, &legal);
+  for (usize i = 0; i < legal.size; ++i) {
+    move_t m = legal.handle[i];
+    if (move_from(m) == from && move_to(m) == to &&
+        move_promotion(m) == promotion) {
+      *mv = m;
+      return true;
+    }
+  }
+  return false;
 }
 
-// Check whether a move is legal (does not leave own king in check)
-bool is_legal_move(board_t bd, move_t mv) {
-  board_t after = apply_move(bd, mv);
-  u8 king_idx;
-  if (mv.piece.id == KING) {
-    king_idx = v2_idx(mv.next_pos); // king moved – new position
+static struct {
+  board_t bd;
+  key_history_t history; // positions before bd since the last irreversible move
+  bool searching; // started and not waited for yet
+  int n_threads;
+  bool pin, numa;
+} uci;
+
+// Called by the main search thread when it is done
+static void uci_bestmove(const search_t *s) {
+  char line[32] = "bestmove ";
+  usize len = 9;
+  if (s->pv.size) {
+    len += move_to_uci(s->pv.moves[0], line + len);
+    if (s->pv.size > 1) {
+      memcpy(line + len, " ponder ", 8);
+      len += 8;
+      len += move_to_uci(s->pv.moves[1], line + len);
+    }
   } else {
-    king_idx = find_king_of_color(after, mv.piece.color);
+    memcpy(line + len, "0000", 4);
+    len += 4;
+  }
+  line[len++] = '\n';
+  fwrite(line, 1, len, stdout);
+  fflush(stdout);
+}
+
+// End the search in progress, if any, once it has printed its best move
+static void uci_stop(void) {
+  if (!uci.searching)
+    return;
+  atomic_store(&threads.stop, true);
+  threads_search_wait();
+  uci.searching = false;
+}
+
+// position startpos|fen <fen> [moves <move>...]
+static void uci_position(char *args) {
+  char *moves = strstr(args, "moves");
+  if (moves)
+    *moves = '\0';
+  if (strncmp(args, "startpos", 8) == 0) {
+    init_board_from_fen(&uci.bd, STARTPOS);
+  } else if (strncmp(args, "fen", 3) == 0) {
+    if (!init_board_from_fen(&uci.bd, args + 3 + strspn(args + 3, " ")) ||
+        !board_is_playable(&uci.bd)) {
+      printf("info string bad fen, using the start position\n");
+      init_board_from_fen(&uci.bd, STARTPOS);
+      moves = NULL;
+    }
+  } else {
+    return;
+  }
+  uci.history.size = 0;
+  if (!moves)
+    return;
+
+  char *save;
+  for (char *tok = strtok_r(moves + 5, " \n", &save); tok;
+       tok = strtok_r(NULL, " \n", &save)) {
+    move_t mv;
+    undo_t undo;
+    if (!parse_uci_move(&uci.bd, tok, &mv)) {
+      printf("info string illegal move %s\n", tok);
+      return;
+    }
+    u64 key = uci.bd.st.key;
+    make_move(&uci.bd, mv, &undo);
+    key_history_push(&uci.history, key, uci.bd.st.rule50);
   }
-  ASSERT(king_idx != UINT8_MAX, "King missing after move");
-  v2 king_pos = {king_idx % WIDTH, king_idx / WIDTH};
-  bool opponent = !mv.piece.color;
-  return !is_attacked(after, king_pos, opponent);
 }
 
-// Generate legal moves from pseudo‑legal list
-move_list_t list_legals(board_t bd, move_list_t *pseudo_legals) {
-  move_list_t ret = {0};
-  for (usize i = 0; i < pseudo_legals->size; ++i) {
-    if (is_legal_move(bd, pseudo_legals->handle[i])) {
-      append(ret, pseudo_legals->handle[i]);
+// go [wtime btime winc binc movestogo movetime depth nodes infinite ponder]
+static void uci_go(char *args) {
+  uci_stop();
+  search_limits_t limits = {0};
+  double time[2] = {0}, inc[2] = {0}, movetime = 0;
+  int movestogo = 0;
+  bool ponder = false;
+
+  char *save;
+  for (char *tok = strtok_r(args, " \n", &save); tok;
+       tok = strtok_r(NULL, " \n", &save)) {
+    if (strcmp(tok, "infinite") == 0) {
+      limits.infinite = true;
+      continue;
+    }
+    if (strcmp(tok, "ponder") == 0) {
+      ponder = true;
+      continue;
     }
+    char *val = strtok_r(NULL, " \n", &save);
+    if (!val)
+      break;
+    if (strcmp(tok, "wtime") == 0)
+      time[WHITE] = atof(val) / 1000;
+    else if (strcmp(tok, "btime") == 0)
+      time[BLACK] = atof(val) / 1000;
+    else if (strcmp(tok, "winc") == 0)
+      inc[WHITE] = atof(val) / 1000;
+    else if (strcmp(tok, "binc") == 0)
+      inc[BLACK] = atof(val) / 1000;
+    else if (strcmp(tok, "movestogo") == 0)
+      movestogo = atoi(val);
+    else if (strcmp(tok, "movetime") == 0)
+      movetime = atof(val) / 1000;
+    else if (strcmp(tok, "depth") == 0)
+      limits.depth = atoi(val);
+    else if (strcmp(tok, "nodes") == 0)
+      limits.nodes = strtoull(val, NULL, 10);
   }
-  return ret;
+
+  bool us = uci.bd.next_to_move;
+  if (movetime > 0) {
+    limits.time = movetime > MOVE_OVERHEAD ? movetime - MOVE_OVERHEAD : 0.001;
+  } else if (time[us] > 0) {
+    time_budget(&limits, time[us], inc[us], movestogo);
+  }
+
+  // A book move is played at once, keeping the clock for later
+  move_t book_move;
+  if (!limits.infinite && !ponder && book_probe(&uci.bd, &book_move)) {
+    char mv[6];
+    move_to_uci(book_move, mv);
+    printf("info string book move\nbestmove %s\n", mv);
+    return;
+  }
+
+  atomic_store(&threads.stop, false);
+  atomic_store(&threads.ponder, ponder);
+  threads_search_start(&uci.bd, &uci.history, limits, uci_bestmove);
+  uci.searching = true;
 }
 
-// Print board with optional red highlight for the king that is in check
-void print_bd(board_t bd) {
+// setoption name <name> value <value>
+static void uci_setoption(char *args) {
+  char *name = strstr(args, "name"), *value = strstr(args, "value");
+  if (!name || !value)
+    return;
+  name += 4 + strspn(name + 4, " ");
+  value += 5 + strspn(value + 5, " ");
+  value[strcspn(value, "\n")] = '\0';
 
-  // Do this woodo to check for edgecases
-  // where apply_move was not used ||
-  // the next_move was just not set?
-  bool in_check = is_check(bd); // is the side to move in check?
-  bd.next_to_move = !bd.next_to_move;
-  in_check |= is_check(bd);
-  bd.next_to_move = !bd.next_to_move;
+  uci_stop();
+  if (strncmp(name, "Hash", 4) == 0) {
+    int mb = atoi(value);
+    if (mb >= 1)
+      tt_init(&tt, (usize)mb, true);
+  } else if (strncmp(name, "Threads", 7) == 0) {
+    int n = atoi(value);
+    if (n >= 1 && n <= MAX_THREADS)
+      threads_init(uci.n_threads = n, uci.pin, uci.numa);
+  } else if (strncmp(name, "EvalFile", 8) == 0) {
+    if (!*value || strcmp(value, "<empty>") == 0)
+      use_nnue = false;
+    else if (!nnue_load(value))
+      printf("info string cannot load %s\n", value);
+  } else if (strncmp(name, "BookFile", 8) == 0) {
+    if (!*value || strcmp(value, "<empty>") == 0)
+      book_close();
+    else if (!book_load(value))
+      printf("info string cannot load %s\n", value);
+  }
+}
 
-  bool checked_king_color =
-      !bd.next_to_move; // colour of the king that is in check (if any)
-                        // the next move is swapped in apply_move so
-                        // its not the next moves king but rather the
-                        // last moves king
-  if (in_check)
-    printf("IN CHECK!!\n");
-  for (int y = HEIGHT - 1; y >= 0; --y) {
-    for (int x = 0; x < WIDTH; ++x) {
-      piece_t pc = bd.handle[v2_idx((v2){x, y})];
+// Read commands from stdin until quit or EOF. The search runs on its own
+// thread so that stop, ponderhit and isready are answered right away.
+int uci_loop(usize hash_mb, int n_threads, bool pin, bool numa) {
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  uci.n_threads = n_threads;
+  uci.pin = pin;
+  uci.numa = numa;
+  if (!hash_mb)
+    hash_mb = 1;
+  if (hash_mb > 65536)
+    hash_mb = 65536;
+  tt_init(&tt, hash_mb, true);
+  init_board_from_fen(&uci.bd, STARTPOS);
 
-      if (in_check && pc.id == KING && pc.color == checked_king_color) {
-        printf("\033[31m");
-        print_pc(pc);
-        printf("\033[0m");
-        putchar(' ');
-      } else {
-        print_pc(pc);
-        putchar(' ');
+  char line[65536];
+  while (fgets(line, sizeof(line), stdin)) {
+    char *args = line + strcspn(line, " \n");
+    if (*args == ' ')
+      *args++ = '\0';
+    else
+      *args = '\0';
+
+    if (strcmp(line, "uci") == 0) {
+      printf("id name sharky\n"
+             "id author djxza\n"
+             "option name Hash type spin default %d min 1 max 65536\n"
+             "option name Threads type spin default %d min 1 max %d\n"
+             "option name EvalFile type string default <empty>\n"
+             "option name BookFile type string default <empty>\n"
+             "uciok\n",
+             (int)hash_mb, uci.n_threads, MAX_THREADS);
+    } else if (strcmp(line, "isready") == 0) {
+      printf("readyok\n");
+    } else if (strcmp(line, "ucinewgame") == 0) {
+      uci_stop();
+      tt_clear(&tt);
+    } else if (strcmp(line, "position") == 0) {
+      uci_stop();
+      uci_position(args);
+    } else if (strcmp(line, "go") == 0) {
+      uci_go(args);
+    } else if (strcmp(line, "stop") == 0) {
+      uci_stop();
+    } else if (strcmp(line, "ponderhit") == 0) {
+      atomic_store(&threads.ponder, false);
+    } else if (strcmp(line, "setoption") == 0) {
+      uci_setoption(args);
+    } else if (strcmp(line, "quit") == 0) {
+      break;
+    }
+  }
+  uci_stop();
+  return 0;
+}
+
+/* =========================
+   Self checks
+   ========================= */
+
+// Consistency checks that perft node counts cannot see, run after the perft
+// suite (perft <depth> without a fen)
+
+// Print the outcome of a check over tested cases, true if none was bad
+static bool check_report(const char *name, u64 tested, u64 bad) {
+  printf("%s %s: %llu tested", bad ? "FAIL" : "ok  ", name,
+         (unsigned long long)tested);
+  if (bad)
+    printf(", %llu bad", (unsigned long long)bad);
+  putchar('\n');
+  return !bad;
+}
+
+// The test positions of the Polyglot book format description
+static bool check_polyglot_keys(void) {
+  static const struct {
+    const char *moves;
+    u64 key;
+  } refs[] = {
+      {"", 0x463b96181691fc9cULL},
+      {"e2e4", 0x823c9b50fd114196ULL},
+      {"e2e4 d7d5", 0x0756b94461c50fb0ULL},
+      {"e2e4 d7d5 e4e5", 0x662fafb965db29d4ULL},
+      {"e2e4 d7d5 e4e5 f7f5", 0x22a48b5a8e47ff78ULL},
+      {"e2e4 d7d5 e4e5 f7f5 e1e2", 0x652a607ca3f242c1ULL},
+      {"e2e4 d7d5 e4e5 f7f5 e1e2 e8f7", 0x00fdd303c946bdd9ULL},
+      {"a2a4 b7b5 h2h4 b5b4 c2c4", 0x3c8123ea7b067637ULL},
+      {"a2a4 b7b5 h2h4 b5b4 c2c4 b4c3 a1a3", 0x5c3f9b829b279560ULL},
+  };
+  u64 bad = 0;
+  for (usize i = 0; i < sizeof(refs) / sizeof(refs[0]); ++i) {
+    board_t bd;
+    init_board_from_fen(&bd, STARTPOS);
+    char moves[64], *save;
+    snprintf(moves, sizeof(moves), "%s", refs[i].moves);
+    for (char *tok = strtok_r(moves, " ", &save); tok;
+         tok = strtok_r(NULL, " ", &save)) {
+      move_t mv;
+      undo_t undo;
+      if (!parse_uci_move(&bd, tok, &mv))
+        break;
+      make_move(&bd, mv, &undo);
+    }
+    bad += polyglot_key(&bd) != refs[i].key;
+  }
+  return check_report("polyglot keys", sizeof(refs) / sizeof(refs[0]), bad);
+}
+
+// The KPK bitbase against a plain retrograde solve of KPK through the move
+// generator, for the pawn on either side
+static bool check_kpk(void) {
+  enum { SOLVE_UNKNOWN, SOLVE_DRAW, SOLVE_WIN, SOLVE_INVALID };
+  u8(*res)[64][64][64] = calloc(2, sizeof(*res)); // [stm][wksq][bksq][psq]
+  ASSERT(res, "Out of memory for the KPK check");
+  board_t empty;
+  init_board_from_fen(&empty, "8/8/8/8/8/8/8/8 w - - 0 1");
+#define KPK_SETUP(bd, stm, wk, bk, p)                                          \
+  do {                                                                         \
+    bd = empty;                                                                \
+    put_piece(&bd, wk, (piece_t){.id = KING, .color = WHITE});                 \
+    put_piece(&bd, bk, (piece_t){.id = KING, .color = BLACK});                 \
+    put_piece(&bd, p, (piece_t){.id = PAWN, .color = WHITE});                  \
+    bd.next_to_move = stm;                                                     \
+    bd.st.key = compute_key(&bd);                                              \
+  } while (0)
+
+  for (int stm = 0; stm < 2; ++stm)
+    for (u8 wk = 0; wk < 64; ++wk)
+      for (u8 bk = 0; bk < 64; ++bk)
+        for (u8 p = 8; p < 56; ++p) {
+          board_t bd;
+          KPK_SETUP(bd, stm, wk, bk, p);
+          bool invalid = wk == bk || wk == p || bk == p ||
+                         square_distance(wk, bk) <= 1 ||
+                         is_attacked(&bd, idx_v2(bd.king_sq[!stm]), stm);
+          res[stm][wk][bk][p] = invalid ? SOLVE_INVALID : SOLVE_UNKNOWN;
+        }
+
+  // Settle positions until nothing changes, what is left is a draw
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int stm = 0; stm < 2; ++stm)
+      for (u8 wk = 0; wk < 64; ++wk)
+        for (u8 bk = 0; bk < 64; ++bk)
+          for (u8 p = 8; p < 56; ++p) {
+            u8 *r = &res[stm][wk][bk][p];
+            if (*r != SOLVE_UNKNOWN)
+              continue;
+            board_t bd;
+            KPK_SETUP(bd, stm, wk, bk, p);
+            move_list_t legal;
+            list_legals(&bd, &legal);
+            if (!legal.size) { // only black can be mated
+              *r = is_check(&bd) ? SOLVE_WIN : SOLVE_DRAW;
+              changed = true;
+              continue;
+            }
+            bool win = false, draw = false, known = true;
+            for (usize i = 0; i < legal.size; ++i) {
+              move_t mv = legal.handle[i];
+              u8 promotion = move_promotion(mv);
+              if (promotion && promotion < ROOK)
+                continue;
+              undo_t undo;
+              make_move(&bd, mv, &undo);
+              u8 v;
+              if (promotion) {
+                // Won unless stalemate or the new piece is taken at once
+                move_list_t replies;
+                list_legals(&bd, &replies);
+                v = replies.size || is_check(&bd) ? SOLVE_WIN : SOLVE_DRAW;
+                for (usize j = 0; j < replies.size; ++j)
+                  if (move_to(replies.handle[j]) == move_to(mv))
+                    v = SOLVE_DRAW;
+              } else if (!bd.piece_count[WHITE][PAWN]) {
+                v = SOLVE_DRAW;
+              } else {
+                v = res[bd.next_to_move][bd.king_sq[WHITE]][bd.king_sq[BLACK]]
+                       [bitscan(bd.pieces[PAWN])];
+              }
+              unmake_move(&bd, mv, &undo);
+              win |= v == SOLVE_WIN;
+              draw |= v == SOLVE_DRAW;
+              known &= v != SOLVE_UNKNOWN;
+            }
+            u8 good = stm == WHITE ? SOLVE_WIN : SOLVE_DRAW;
+            u8 bad = stm == WHITE ? SOLVE_DRAW : SOLVE_WIN;
+            if (stm == WHITE ? win : draw)
+              *r = good;
+            else if (known)
+              *r = bad;
+            changed |= *r != SOLVE_UNKNOWN;
+          }
+  }
+
+  // Every valid position, then the same with colours and ranks swapped
+  u64 tested = 0, bad = 0;
+  for (int stm = 0; stm < 2; ++stm)
+    for (u8 wk = 0; wk < 64; ++wk)
+      for (u8 bk = 0; bk < 64; ++bk)
+        for (u8 p = 8; p < 56; ++p) {
+          u8 r = res[stm][wk][bk][p];
+          if (r == SOLVE_INVALID)
+            continue;
+          board_t bd;
+          KPK_SETUP(bd, stm, wk, bk, p);
+          bad += kpk_win(&bd) != (r == SOLVE_WIN);
+          bd = empty;
+          put_piece(&bd, wk ^ 56, (piece_t){.id = KING, .color = BLACK});
+          put_piece(&bd, bk ^ 56, (piece_t){.id = KING, .color = WHITE});
+          put_piece(&bd, p ^ 56, (piece_t){.id = PAWN, .color = BLACK});
+          bd.next_to_move = !stm;
+          bd.st.key = compute_key(&bd);
+          bad += kpk_win(&bd) != (r == SOLVE_WIN);
+          tested += 2;
+        }
+#undef KPK_SETUP
+  free(res);
+  return check_report("kpk bitbase", tested, bad);
+}
+
+// Malformed FENs that would write outside the board or leave it
+// inconsistent must be refused
+static bool check_bad_fens(void) {
+  static const char *fens[] = {
+      "rrrrrrrrrrrrrrrrrrrr/8/8/8/8/8/8/4K2k w - - 0 1",
+      "4k3/8/8/8/////////8/4K3 w - - 0 1",
+      "4k3/8/8/8/8/8/8 w - - 0 1",
+      "4k3/8/8/8/8/8/8/4K3X w - - 0 1",
+      "4k3/8/8/8/8/8/8/4K3 x - - 0 1",
+      "4kk2/8/8/8/8/8/8/4K3 w - - 0 1",
+      "P3k3/8/8/8/8/8/8/4K3 w - - 0 1",
+      "4k3/8/8/8/8/8/8/4K3 w - a1 0 1",
+      "4k3/8/8/8/8/8/3P4/4K3 w - e3 0 1",
+      "4k3/8/8/8/4pP2/8/8/4K3 w - e6 0 1",
+      "r3k2r/8/8/8/8/8/8/R3K2R w KQxq - 0 1",
+      "r3k2r/8/8/8/8/8/8/R3K2R w -K - 0 1",
+  };
+  u64 bad = 0;
+  for (usize i = 0; i < sizeof(fens) / sizeof(fens[0]); ++i) {
+    board_t bd;
+    bad += init_board_from_fen(&bd, fens[i]);
+  }
+  return check_report("bad fens", sizeof(fens) / sizeof(fens[0]), bad);
+}
+
+// Every field of the two boards, padding aside
+static bool boards_equal(const board_t *a, const board_t *b) {
+  return a->next_to_move == b->next_to_move &&
+         !memcmp(a->pieces, b->pieces, sizeof(a->pieces)) &&
+         !memcmp(a->colors, b->colors, sizeof(a->colors)) &&
+         a->occupied == b->occupied &&
+         !memcmp(a->mailbox, b->mailbox, sizeof(a->mailbox)) &&
+         !memcmp(a->king_sq, b->king_sq, sizeof(a->king_sq)) &&
+         !memcmp(a->piece_count, b->piece_count, sizeof(a->piece_count)) &&
+         a->st.castling == b->st.castling &&
+         a->st.ep_square == b->st.ep_square &&
+         a->st.rule50 == b->st.rule50 && a->st.ply == b->st.ply &&
+         a->st.key == b->st.key && a->psq[0] == b->psq[0] &&
+         a->psq[1] == b->psq[1] && a->phase == b->phase;
+}
+
+#define CHECK_WALK_PLIES 150
+
+// board_to_fen then init_board_from_fen gives back the same board, along
+// random games from the bench positions, and the bench FENs come back
+// verbatim. The diagram of each position fits DIAGRAM_MAX.
+static bool check_fen_roundtrip(void) {
+  u64 seed = 7, tested = 0, bad = 0;
+  for (usize i = 0; i < sizeof(bench_fens) / sizeof(bench_fens[0]); ++i) {
+    board_t bd;
+    char fen[FEN_MAX], diagram[DIAGRAM_MAX];
+    init_board_from_fen(&bd, bench_fens[i]);
+    board_to_fen(&bd, fen);
+    bad += strcmp(fen, bench_fens[i]) != 0;
+    for (int ply = 0; ply < CHECK_WALK_PLIES; ++ply) {
+      move_list_t legal;
+      list_legals(&bd, &legal);
+      if (!legal.size)
+        break;
+      undo_t undo;
+      make_move(&bd, legal.handle[rand64(&seed) % legal.size], &undo);
+
+      board_t parsed;
+      usize len = board_to_fen(&bd, fen);
+      tested++;
+      bad += len != strlen(fen) || len >= FEN_MAX ||
+             !init_board_from_fen(&parsed, fen) ||
+             !boards_equal(&parsed, &bd) ||
+             board_to_diagram(&bd, diagram) >= DIAGRAM_MAX;
+    }
+  }
+  return check_report("fen round trip", tested, bad);
+}
+
+static bool list_contains(const move_list_t *list, move_t mv) {
+  for (usize i = 0; i < list->size; ++i)
+    if (list->handle[i] == mv)
+      return true;
+  return false;
+}
+
+// Along random games from the bench positions: the legal generator gives
+// exactly the pseudo-legal moves that pass is_legal_move, split between
+// captures and quiets; move_is_legal agrees with it on those and on random
+// move words; and every legal move keeps the incremental key and is undone
+// back to the same board.
+static bool check_make_unmake(void) {
+  u64 seed = 12345, tested = 0, bad = 0;
+  for (usize i = 0; i < sizeof(bench_fens) / sizeof(bench_fens[0]); ++i) {
+    board_t bd;
+    init_board_from_fen(&bd, bench_fens[i]);
+    for (int ply = 0; ply < CHECK_WALK_PLIES; ++ply) {
+      move_list_t pseudo, legal, captures, quiets;
+      list_pseudo_legals(&bd, &pseudo);
+      list_legals(&bd, &legal);
+      list_legal_captures(&bd, &captures);
+      list_legal_quiets(&bd, &quiets);
+      tested++;
+
+      usize n_legal = 0;
+      for (usize j = 0; j < pseudo.size; ++j) {
+        move_t mv = pseudo.handle[j];
+        bool ok = is_legal_move(&bd, mv);
+        n_legal += ok;
+        bad += ok != list_contains(&legal, mv) || ok != move_is_legal(&bd, mv);
+      }
+      bad += n_legal != legal.size ||
+             captures.size + quiets.size != legal.size;
+      for (usize j = 0; j < captures.size; ++j)
+        bad += !list_contains(&legal, captures.handle[j]);
+      for (usize j = 0; j < quiets.size; ++j)
+        bad += !list_contains(&legal, quiets.handle[j]);
+      for (int j = 0; j < 16; ++j) {
+        move_t mv = (move_t)rand64(&seed);
+        bad += move_is_legal(&bd, mv) != list_contains(&legal, mv);
+      }
+
+      for (usize j = 0; j < legal.size; ++j) {
+        board_t before = bd;
+        undo_t undo;
+        make_move(&bd, legal.handle[j], &undo);
+        bad += bd.st.key != compute_key(&bd);
+        unmake_move(&bd, legal.handle[j], &undo);
+        bad += !boards_equal(&bd, &before);
       }
+
+      if (!legal.size)
+        break;
+      undo_t undo;
+      make_move(&bd, legal.handle[rand64(&seed) % legal.size], &undo);
     }
-    putchar('\n');
   }
+  return check_report("make/unmake", tested, bad);
+}
+
+// Run every check, returns how many failed
+int self_checks(void) {
+  int failures = 0;
+  failures += !check_polyglot_keys();
+  failures += !check_kpk();
+  failures += !check_bad_fens();
+  failures += !check_fen_roundtrip();
+  failures += !check_make_unmake();
+  return failures;
+}
+
+static int usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s                      UCI engine on stdin/stdout\n"
+          "       %s uci                  same\n"
+          "       %s example              run the example\n"
+          "       %s perft <depth> [fen]  count nodes, reference suite if no "
+          "fen\n"
+          "       %s divide <depth> [fen] per root move counts\n"
+          "       %s search <depth> [fen] search and print the best move\n"
+          "       %s bench [depth]        search the bench positions, default "
+          "depth %d\n"
+          "       %s epd <depth> [file]   search every FEN/EPD line of file "
+          "(or stdin)\n"
+          "       %s match <games> <tc> <A> <B> [file] self-play until the "
+          "SPRT decides\n"
+          "options, before the command:\n"
+          "  -nnue <file>  evaluate with a network instead of PSTs\n"
+          "  -book <file>  play from a Polyglot book in UCI mode\n"
+          "  -threads <n>  search (Lazy SMP) and perft threads\n"
+          "  -hash <mb>    transposition table and perft cache size, 0 for\n"
+          "                no perft cache\n"
+          "  -pin          pin each search thread to one CPU\n"
+          "  -numa         spread search threads over NUMA nodes\n"
+          "  -stats <file> with -DSTATS, write the stats report there as\n"
+          "                JSON instead of to stderr\n"
+          "  -sprt <elo0> <elo1>\n"
+          "                match hypotheses, default 0 and 5\n",
+          prog, prog, prog, prog, prog, prog, prog, BENCH_DEPTH, prog, prog);
+  return 1;
+}
+
+/* =========================
+   Self-play match
+   ========================= */
+
+// Two configurations of the engine play each other, one game per worker
+// thread at a time, every game on its own board with its own pair of
+// search_t. Openings are played twice with colours swapped, and the match
+// stops as soon as the SPRT accepts either hypothesis.
+
+#define MATCH_MAX_PLIES 400 // longer games are scored as draws
+#define SPRT_ALPHA 0.05     // chance of accepting elo1 when elo0 holds
+#define SPRT_BETA 0.05      // and the other way round
+
+typedef struct match_config_t {
+  bool nnue;        // evaluate with the network, else the PSTs
+  double time, inc; // clock in seconds, no clock if time is 0
+  u64 nodes;        // per move, 0 for no limit
+  int depth;        // likewise
+} match_config_t;
+
+typedef enum {
+  END_NONE,
+  END_MATE,
+  END_STALEMATE,
+  END_FIFTY,
+  END_REPETITION,
+  END_MATERIAL,
+  END_TIME,
+  END_LENGTH,
+} game_end_t;
+
+static const char *const game_end_name[] = {
+    "", "checkmate", "stalemate", "fifty moves", "repetition",
+    "material", "time", "max length",
+};
+
+static struct {
+  match_config_t configs[2]; // A and B
+  double elo0, elo1;         // SPRT hypotheses, A against B
+  char **openings;
+  usize n_openings;
+  u64 games;
+  usize hash_mb;    // of each engine's table
+  _Atomic u64 next; // next game to start
+  atomic_bool stop; // SPRT decided
+  pthread_mutex_t lock;
+  // Under lock, results from A's side
+  u64 done, wins, draws, losses;
+  double llr;
+} match = {.elo0 = 0, .elo1 = 5, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+static inline double elo_to_score(double elo) {
+  return 1 / (1 + pow(10, -elo / 400));
+}
+
+static inline double score_to_elo(double score) {
+  if (score <= 0.001)
+    score = 0.001;
+  if (score >= 0.999)
+    score = 0.999;
+  return -400 * log10(1 / score - 1);
+}
+
+// Log-likelihood ratio of elo1 against elo0 for these results, the normal
+// approximation of the trinomial GSPRT. Half a game of each outcome is added
+// so that a run without draws or losses still has a variance.
+static double sprt_llr(u64 wins, u64 draws, u64 losses, double elo0,
+                       double elo1) {
+  double w = wins + 0.5, d = draws + 0.5, l = losses + 0.5, n = w + d + l;
+  double score = (w + d / 2) / n;
+  double var = (w + d / 4) / n - score * score;
+  if (var <= 0)
+    return 0;
+  double s0 = elo_to_score(elo0), s1 = elo_to_score(elo1);
+  return (s1 - s0) * (2 * score - s0 - s1) * n / (2 * var);
+}
+
+// Elo of A over B and the half width of its 95% interval
+static void match_elo(double *elo, double *margin) {
+  double n = (double)match.done;
+  double score = (match.wins + match.draws / 2.0) / n;
+  double var = (match.wins + match.draws / 4.0) / n - score * score;
+  double err = 1.96 * sqrt(var > 0 ? var / n : 0);
+  *elo = score_to_elo(score);
+  *margin = (score_to_elo(score + err) - score_to_elo(score - err)) / 2;
+}
+
+// No mate possible or reachable: at most a lone minor piece on each side
+static bool insufficient_material(const board_t *bd) {
+  for (int c = 0; c < 2; ++c)
+    if (bd->piece_count[c][PAWN] || bd->piece_count[c][ROOK] ||
+        bd->piece_count[c][QUEEN] ||
+        bd->piece_count[c][KNIGHT] + bd->piece_count[c][BISHOP] > 1)
+      return false;
+  return true;
+}
+
+// Whether the game is over at bd, history holding the positions before it
+// since the last irreversible move, and how
+static game_end_t game_end(board_t *bd, const key_history_t *history) {
+  move_list_t legal;
+  list_legals(bd, &legal);
+  if (!legal.size)
+    return is_check(bd) ? END_MATE : END_STALEMATE;
+  if (bd->st.rule50 >= 100)
+    return END_FIFTY;
+  int seen = 0;
+  for (int i = history->size - 4; i >= 0; i -= 2)
+    seen += history->keys[i] == bd->st.key;
+  if (seen >= 2)
+    return END_REPETITION;
+  if (insufficient_material(bd))
+    return END_MATERIAL;
+  return END_NONE;
+}
+
+// Play game g between engines[0] (A) and engines[1] (B). Returns the result
+// for A, 1, 0 or -1 for a win, draw or loss, how the game ended and the FEN
+// of the final position.
+static int match_play(search_t *engines[2], u64 g, game_end_t *end,
+                      char fen[FEN_MAX]) {
+  board_t bd;
+  init_board_from_fen(&bd, match.n_openings
+                               ? match.openings[g / 2 % match.n_openings]
+                               : STARTPOS);
+  key_history_t history = {.size = 0};
+  int a_color = g % 2 ? BLACK : WHITE;
+  double clock[2] = {match.configs[0].time, match.configs[1].time};
+  for (int e = 0; e < 2; ++e) {
+    tt_clear(engines[e]->tt);
+    memset(engines[e]->history, 0, sizeof(engines[e]->history));
+    memset(engines[e]->counter_moves, 0, sizeof(engines[e]->counter_moves));
+  }
+
+  for (int ply = 0;; ++ply) {
+    int side = bd.next_to_move == a_color ? 0 : 1;
+    board_to_fen(&bd, fen);
+    *end = game_end(&bd, &history);
+    if (*end == END_MATE)
+      return side ? 1 : -1;
+    if (*end)
+      return 0;
+    if (ply == MATCH_MAX_PLIES) {
+      *end = END_LENGTH;
+      return 0;
+    }
+
+    const match_config_t *cfg = &match.configs[side];
+    search_t *s = engines[side];
+    s->bd = bd;
+    memcpy(s->keys, history.keys, history.size * sizeof(u64));
+    s->root_keys = history.size;
+    s->limits = (search_limits_t){
+        .depth = cfg->depth, .nodes = cfg->nodes, .quiet = true};
+    if (cfg->time)
+      time_budget(&s->limits, clock[side], cfg->inc, 0);
+    s->start = now_seconds();
+    tt_new_search(s->tt);
+    iterate(s);
+    if (cfg->time) {
+      clock[side] -= now_seconds() - s->start;
+      if (clock[side] < 0) {
+        *end = END_TIME;
+        return side ? 1 : -1;
+      }
+      clock[side] += cfg->inc;
+    }
+
+    // The first iteration always completes, there is a move
+    u64 key = bd.st.key;
+    undo_t undo;
+    make_move(&bd, s->pv.moves[0], &undo);
+    key_history_push(&history, key, bd.st.rule50);
+  }
+}
+
+// Count the result of game g and print the standing and where the game
+// ended, stopping the match once the SPRT decides
+static void match_record(u64 g, int result, game_end_t end, const char *fen) {
+  pthread_mutex_lock(&match.lock);
+  match.done++;
+  match.wins += result > 0;
+  match.draws += !result;
+  match.losses += result < 0;
+  match.llr = sprt_llr(match.wins, match.draws, match.losses, match.elo0,
+                       match.elo1);
+  double lower = log(SPRT_BETA / (1 - SPRT_ALPHA));
+  double upper = log((1 - SPRT_BETA) / SPRT_ALPHA);
+  if (match.llr <= lower || match.llr >= upper)
+    atomic_store(&match.stop, true);
+
+  bool a_white = g % 2 == 0;
+  const char *score = !result ? "1/2-1/2"
+                      : (result > 0) == a_white ? "1-0"
+                                                : "0-1";
+  double elo, margin;
+  match_elo(&elo, &margin);
+  printf("game %llu %s %s %s | +%llu =%llu -%llu | elo %.1f +- %.1f | "
+         "llr %.2f (%.2f, %.2f) | %s\n",
+         (unsigned long long)g + 1, a_white ? "A-B" : "B-A", score,
+         game_end_name[end], (unsigned long long)match.wins,
+         (unsigned long long)match.draws, (unsigned long long)match.losses,
+         elo, margin, match.llr, lower, upper, fen);
+  fflush(stdout);
+  pthread_mutex_unlock(&match.lock);
+}
+
+static void match_worker(int id) {
+  // A plays with the thread's search_t, B with one of its own, and each has
+  // its own hash table so neither probes the other's entries
+  tt_t tables[2] = {0};
+  search_t *b = mmap(NULL, sizeof(search_t), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT(b != MAP_FAILED, "Out of memory for match engines");
+  search_t *engines[2] = {threads.workers[id], b};
+  for (int e = 0; e < 2; ++e) {
+    engines[e]->id = 0;
+    engines[e]->solo = true;
+    engines[e]->pondering = false;
+    engines[e]->nnue = match.configs[e].nnue;
+    engines[e]->tt = &tables[e];
+    tt_init(&tables[e], match.hash_mb, false);
+  }
+
+  while (!atomic_load(&match.stop)) {
+    u64 g = atomic_fetch_add(&match.next, 1);
+    if (g >= match.games)
+      break;
+    game_end_t end;
+    char fen[FEN_MAX];
+    int result = match_play(engines, g, &end, fen);
+    match_record(g, result, end, fen);
+  }
+  tt_free(&tables[0]);
+  tt_free(&tables[1]);
+  munmap(b, sizeof(search_t));
+}
+
+// <seconds>[+<increment>], 0 for no clock
+static bool parse_tc(const char *str, match_config_t *cfg) {
+  cfg->inc = 0;
+  return sscanf(str, "%lf+%lf", &cfg->time, &cfg->inc) >= 1 &&
+         cfg->time >= 0 && cfg->inc >= 0;
+}
+
+// Settings of one side: "-" for the defaults, or a comma separated list of
+// psq, nnue, tc=<tc>, nodes=<n> and depth=<n> applied over the match time
+// control tc
+static bool match_parse_config(const char *spec, const char *tc,
+                               match_config_t *cfg) {
+  *cfg = (match_config_t){.nnue = use_nnue};
+  if (!parse_tc(tc, cfg))
+    return false;
+
+  char buf[256];
+  snprintf(buf, sizeof(buf), "%s", strcmp(spec, "-") ? spec : "");
+  char *save;
+  for (char *tok = strtok_r(buf, ",", &save); tok;
+       tok = strtok_r(NULL, ",", &save)) {
+    if (strcmp(tok, "psq") == 0) {
+      cfg->nnue = false;
+    } else if (strcmp(tok, "nnue") == 0) {
+      if (!nnue.map) {
+        fprintf(stderr, "nnue needs a network, load one with -nnue\n");
+        return false;
+      }
+      cfg->nnue = true;
+    } else if (strncmp(tok, "tc=", 3) == 0) {
+      if (!parse_tc(tok + 3, cfg))
+        return false;
+    } else if (strncmp(tok, "nodes=", 6) == 0) {
+      cfg->nodes = strtoull(tok + 6, NULL, 10);
+    } else if (strncmp(tok, "depth=", 6) == 0) {
+      cfg->depth = atoi(tok + 6);
+    } else {
+      fprintf(stderr, "unknown setting %s\n", tok);
+      return false;
+    }
+  }
+  if (!cfg->time && !cfg->nodes && !cfg->depth) {
+    fprintf(stderr, "%s: no time, node or depth limit\n", spec);
+    return false;
+  }
+  return true;
+}
+
+// Play up to games games of A against B on all threads, openings taken in
+// turn from the playable lines of in (the start position if NULL), the
+// engines sharing hash_mb megabytes of hash tables evenly. Returns the
+// final log-likelihood ratio.
+double match_run(u64 games, usize hash_mb, FILE *in) {
+  char *line = NULL;
+  usize cap = 0, size = 0;
+  while (in && getline(&line, &cap, in) >= 0) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (epd_is_comment(line))
+      continue;
+    board_t bd;
+    if (!init_board_from_fen(&bd, line) || !board_is_playable(&bd))
+      continue;
+    if (match.n_openings == size) {
+      size = size ? size * 2 : 256;
+      match.openings = realloc(match.openings, size * sizeof(char *));
+      ASSERT(match.openings, "Out of memory for openings");
+    }
+    match.openings[match.n_openings++] = strdup(line);
+  }
+  free(line);
+  fprintf(stderr, "%zu openings, sprt elo0 %g elo1 %g alpha %g beta %g\n",
+          match.n_openings, match.elo0, match.elo1, SPRT_ALPHA, SPRT_BETA);
+
+  match.games = games;
+  match.hash_mb = hash_mb / (2 * (usize)threads.n);
+  if (!match.hash_mb)
+    match.hash_mb = 1;
+  double start = now_seconds();
+  threads_run(match_worker);
+
+  double elo = 0, margin = 0;
+  if (match.done)
+    match_elo(&elo, &margin);
+  const char *verdict = match.llr >= log((1 - SPRT_BETA) / SPRT_ALPHA)
+                            ? "H1 accepted"
+                        : match.llr <= log(SPRT_BETA / (1 - SPRT_ALPHA))
+                            ? "H0 accepted"
+                            : "inconclusive";
+  printf("%llu games in %.1fs, +%llu =%llu -%llu, elo %.1f +- %.1f, "
+         "llr %.2f, %s\n",
+         (unsigned long long)match.done, now_seconds() - start,
+         (unsigned long long)match.wins, (unsigned long long)match.draws,
+         (unsigned long long)match.losses, elo, margin, match.llr, verdict);
+  for (usize i = 0; i < match.n_openings; ++i)
+    free(match.openings[i]);
+  free(match.openings);
+  return match.llr;
 }
 
 /* =========================
    Main (example)
    ========================= */
 
-int main(void) {
+static int example(void) {
   board_t bd = {0};
   init_board_from_fen(&bd, "8/8/8/2k5/3b4/8/1P6/K7");
   bd.next_to_move = WHITE;
 
   printf("Initial board:\n");
-  print_bd(bd);
+  print_bd(&bd);
   printf("\n");
 
-  if (is_check(bd)) {
+  if (is_check(&bd)) {
     printf("White is in check!\n\n");
   } else {
     printf("White is not in check.\n\n");
   }
 
-  move_list_t pseudo = list_pseudo_legals(bd);
+  move_list_t pseudo;
+  list_pseudo_legals(&bd, &pseudo);
   printf("Pseudo‑legal moves for White:\n");
-  mprintf("%l", &pseudo);
+  mprintf("%l", &bd, &pseudo);
 
-  move_list_t legal = list_legals(bd, &pseudo);
+  move_list_t legal;
+  list_legals(&bd, &legal);
   printf("\nLegal moves for White:\n");
-  mprintf("%l", &legal);
+  mprintf("%l", &bd, &legal);
+
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  init_attacks();
+  init_zobrist();
+  init_psq();
+
+  // Leading options, shifted off so the command is argv[1] again
+  int n_threads = 1;
+  usize hash_mb = DEFAULT_HASH_MB;
+  bool pin = false, numa = false;
+  while (argc >= 2 && argv[1][0] == '-') {
+    int used = 1;
+    if (strcmp(argv[1], "-nnue") == 0 && argc >= 3) {
+      // Evaluate with a network instead of the PST tables
+      if (!nnue_load(argv[2]))
+        return 1;
+      fprintf(stderr, "using NNUE %s (%s)\n", argv[2], NNUE_SIMD);
+      used = 2;
+    } else if (strcmp(argv[1], "-threads") == 0 && argc >= 3) {
+      n_threads = atoi(argv[2]);
+      if (n_threads < 1 || n_threads > MAX_THREADS)
+        return usage(argv[0]);
+      used = 2;
+    } else if (strcmp(argv[1], "-hash") == 0 && argc >= 3) {
+      hash_mb = strtoull(argv[2], NULL, 10);
+      used = 2;
+    } else if (strcmp(argv[1], "-book") == 0 && argc >= 3) {
+      if (!book_load(argv[2]))
+        return 1;
+      used = 2;
+    } else if (strcmp(argv[1], "-stats") == 0 && argc >= 3) {
+      stats_file = argv[2];
+      used = 2;
+    } else if (strcmp(argv[1], "-sprt") == 0 && argc >= 4) {
+      match.elo0 = atof(argv[2]);
+      match.elo1 = atof(argv[3]);
+      if (match.elo1 <= match.elo0)
+        return usage(argv[0]);
+      used = 3;
+    } else if (strcmp(argv[1], "-pin") == 0) {
+      pin = true;
+    } else if (strcmp(argv[1], "-numa") == 0) {
+      numa = true;
+    } else {
+      return usage(argv[0]);
+    }
+    argv[used] = argv[0];
+    argv += used;
+    argc -= used;
+  }
+  threads_init(n_threads, pin, numa);
+#ifdef STATS
+  atexit(stats_report);
+#endif
+
+  if (argc < 2 || strcmp(argv[1], "uci") == 0)
+    return uci_loop(hash_mb, n_threads, pin, numa);
+  if (strcmp(argv[1], "example") == 0)
+    return example();
+  if (strcmp(argv[1], "bench") == 0) {
+    int depth = argc >= 3 ? atoi(argv[2]) : BENCH_DEPTH;
+    if (depth < 1)
+      return usage(argv[0]);
+    tt_init(&tt, hash_mb ? hash_mb : 1, false);
+    bench(depth);
+    return 0;
+  }
+  if (strcmp(argv[1], "match") == 0) {
+    u64 games = argc >= 6 ? strtoull(argv[2], NULL, 10) : 0;
+    if (!games || !match_parse_config(argv[4], argv[3], &match.configs[0]) ||
+        !match_parse_config(argv[5], argv[3], &match.configs[1]))
+      return usage(argv[0]);
+    FILE *in = NULL;
+    if (argc >= 7 && !(in = fopen(argv[6], "r"))) {
+      perror(argv[6]);
+      return 1;
+    }
+    match_run(games, hash_mb, in);
+    if (in)
+      fclose(in);
+    return 0;
+  }
+
+  bool is_perft = strcmp(argv[1], "perft") == 0;
+  bool is_divide = strcmp(argv[1], "divide") == 0;
+  bool is_search = strcmp(argv[1], "search") == 0;
+  bool is_epd = strcmp(argv[1], "epd") == 0;
+  if (!(is_perft || is_divide || is_search || is_epd) || argc < 3)
+    return usage(argv[0]);
+
+  int depth = atoi(argv[2]);
+  if (depth < 1)
+    return usage(argv[0]);
+
+  if (is_epd) {
+    FILE *in = argc >= 4 ? fopen(argv[3], "r") : stdin;
+    if (!in) {
+      perror(argv[3]);
+      return 1;
+    }
+    tt_init(&tt, hash_mb ? hash_mb : 1, false);
+    epd_batch(in, (search_limits_t){.depth = depth});
+    return 0;
+  }
+
+  board_t bd;
+  if (!init_board_from_fen(&bd, argc >= 4 ? argv[3] : STARTPOS) ||
+      !board_is_playable(&bd)) {
+    fprintf(stderr, "bad fen: %s\n", argv[3]);
+    return 1;
+  }
+
+  if (is_search) {
+    tt_init(&tt, hash_mb ? hash_mb : 1, false);
+    search_t *s = threads_search(&bd, NULL, (search_limits_t){.depth = depth});
+    char mv[8] = "(none)";
+    if (s->pv.size)
+      move_to_uci(s->pv.moves[0], mv);
+    printf("bestmove %s\n", mv);
+    return 0;
+  }
 
-  free(pseudo.handle);
-  free(legal.handle);
+  perft_cache_init(hash_mb);
+  if (is_perft && argc < 4)
+    return perft_suite(depth) + self_checks() ? 1 : 0;
+
+  double start = now_seconds();
+  u64 nodes = is_perft ? perft_parallel(&bd, depth) : divide(&bd, depth);
+  double secs = now_seconds() - start;
+  if (is_divide)
+    putchar('\n');
+  print_perft_stats(nodes, secs);
   return 0;
 }